@@ -3,37 +3,425 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <wctype.h>
+#include <locale.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* Subtree summaries of the word tree, see word_node_augment() */
+struct word_node;
+void word_node_augment(struct word_node *node);
+#define RB_AUGMENT(x)	word_node_augment(x)
 
 #include "tree.h"
 
 #define ASSERT(cond) {if (!(cond)) (*((char *)0) = 0);}
 
+#ifndef WORD_DB
 #define WORD_DB "/usr/share/dict/words"
+#endif
 #define MAX_WORD_SIZE 80
-#define PLACE_HOLDER_CHAR '9'
+
+/*
+ * Keys depend on the normalization options (-c, -d) and letter codes on
+ * the dictionary read, so there is no index mkwordsdb could build ahead
+ * of time; the embedded dictionary mode is for wsearch and wsolver only.
+ */
+#ifdef EMBEDDED_DB
+#error "anagram does not support -DEMBEDDED_DB; it reads WORD_DB at run time"
+#endif
 
 struct list {
 	char *word;
 	struct list *next;
 };
 
+/*
+ * Once loaded, every key is interned: copied into one string pool in
+ * sorted order and named by its index there, a 32-bit word ID. IDs are
+ * therefore ordered like strcmp() on the keys. Word lists, the search
+ * stack and the solutions all hold IDs and refer to the pool, so the
+ * search never copies a word. Each key is followed in the pool by its
+ * signature, worked out while loading.
+ */
+typedef uint32_t word_id_t;
+
+#define NO_WORD UINT32_MAX
+#define WORD_OF(id)	(word_pool + word_offs[(id)])
+#define SIG_OF(id)	(WORD_OF(id) + word_lens[(id)] + 1)
+
+typedef struct word_list {
+	word_id_t *wl_ids;
+	int wl_n;
+	int wl_size;
+} word_list_t;
+
+/*
+ * The tree is keyed on the normalized form of each word (see
+ * normalize_word()); every spelling in the dictionary that normalizes to
+ * the same key hangs off its node as a surface form.
+ *
+ * Each node also summarizes its subtree: the letters (as LETTER_BIT()s)
+ * that every word in it uses, and its shortest word. A subtree covers a
+ * range of sorted words, so its words share a prefix and sub_need is
+ * rarely empty below the top few levels. Any subtree needing a letter the
+ * input lacks, or longer words than the input, holds no sub-words of it.
+ */
 struct word_node {
 	char *word;
+	uint64_t hash;			/* hash_word(word) */
+	uint64_t sig_hash;		/* hash_word() of its signature */
+	struct list *forms;
+	struct word_node *sig_next;	/* next word with the same signature */
+	word_id_t id;
+	uint32_t mask;			/* letters of word */
+	uint32_t sub_need;		/* letters of every word in subtree */
+	uint8_t len;
+	uint8_t sub_min_len;
 	RB_ENTRY(word_node) rb_node;
 };
 
 typedef struct word_node wnode_t;
 
+/*
+ * Blocked Bloom filter sitting in front of the tree. Each word sets
+ * BLOOM_K bits inside a single 512-bit block (one cache line), so most
+ * misses are turned away after one line read instead of a full tree
+ * descent with a string compare at every level.
+ */
+#define BLOOM_BITS_PER_WORD 10
+#define BLOOM_K 6
+
+struct bloom_block {
+	uint64_t bb_bits[8];
+} __attribute__((aligned(64)));
+
+typedef struct bloom_filter {
+	struct bloom_block *bf_blocks;
+	uint32_t bf_nblocks;
+	uint64_t bf_probes;	/* exact lookups made */
+	uint64_t bf_rejects;	/* lookups answered by the filter alone */
+	uint64_t bf_false_pos;	/* passed the filter, but not in the tree */
+	uint64_t bf_hits;	/* found in the tree */
+} bloom_filter_t;
+
 typedef struct tree_handle {
 	RB_HEAD(word_tree, word_node) th_tree;
+	uint32_t th_nwords;
+	bloom_filter_t th_bloom;
 } tree_handle_t;
 
+/*
+ * Alphabet of the loaded dictionary. Every letter (Unicode code point) used
+ * by the dictionary gets a dense code from 1 to al_nletters, assigned in
+ * code point order, and words are kept internally as strings of these one
+ * byte codes. The byte oriented code below (permutations, the tree, the
+ * letter counts) therefore works the same for any language, and anything
+ * indexed by letter needs only al_nletters + 1 entries. Assigning codes in
+ * code point order keeps sorted output in the same order as before.
+ */
+#define MAX_LETTERS 255
+#define CP_TABLE_SIZE 4096
+
+struct cp_count {
+	uint32_t cc_cp;
+	uint64_t cc_count;
+};
+
+typedef struct alphabet {
+	int al_nletters;
+	uint32_t al_cp[MAX_LETTERS + 1];	/* code -> code point */
+	uint64_t al_freq[MAX_LETTERS + 1];	/* uses in the dictionary */
+	uint8_t al_ascii[128];			/* ASCII -> code, 0 if unused */
+} alphabet_t;
+
+/*
+ * Signature index. The signature of a word is its letter codes in sorted
+ * order, which all of its anagrams share. Each entry chains the words with
+ * that signature through wnode_t's sig_next, so every word buildable from
+ * a given multiset of letters is found with a single probe.
+ */
+struct sig_entry {
+	char *se_sig;
+	wnode_t *se_words;
+	struct sig_entry *se_next;
+};
+
+typedef struct sig_index {
+	struct sig_entry **si_buckets;
+	struct sig_entry *si_entries;	/* one block for every entry */
+	uint32_t si_nbuckets;	/* power of two */
+	uint32_t si_nsigs;
+	uint64_t si_probes;
+	uint64_t si_hits;
+} sig_index_t;
+
+/*
+ * Signature trie (-a), built over the signature index. A signature is a
+ * path of letter codes from the root, and the node it ends at points to
+ * its index entry. The codes along a path never decrease, and children
+ * are kept in increasing code order. Every word buildable from a rack
+ * lies on a path that only steps to letters still left in the rack, so a
+ * search following such steps reaches exactly the buildable signatures.
+ */
+struct sig_trie_node {
+	uint32_t tn_child;		/* first child, 0 if none */
+	uint32_t tn_sibling;		/* next child of the parent, 0 if last */
+	struct sig_entry *tn_entry;	/* signature ending here, or NULL */
+	uint8_t tn_code;
+};
+
+typedef struct sig_trie {
+	struct sig_trie_node *st_nodes;	/* st_nodes[0] is the root */
+	size_t st_nnodes;
+	size_t st_size;
+	uint64_t st_visits;
+} sig_trie_t;
+
+/*
+ * Candidate words for the rarest-letter search (-r), in word list order.
+ * cs_by_letter[c] lists the candidates that use letter code c. c_mask has
+ * a bit per letter the word uses (codes beyond 32 share bits), so a word
+ * needing a letter that is all used up is rejected with one AND.
+ */
+struct cand {
+	word_id_t c_id;
+	char *c_word;
+	int c_len;
+	uint32_t c_mask;
+	int c_banned;	/* depth + 1 of the level that excluded it, or 0 */
+};
+
+typedef struct cand_set {
+	struct cand *cs_cands;
+	int cs_ncands;
+	int **cs_by_letter;
+	int *cs_nby_letter;
+} cand_set_t;
+
+#define LETTER_BIT(code)	(1u << (((code) - 1) & 31))
+
+/*
+ * Anagram classes (-g). Candidates that are anagrams of each other ("art",
+ * "rat", "tar") can stand in for one another in any solution, so the
+ * search runs over their classes and each distinct solution is found once
+ * instead of once per choice of words. Classes are in word list order of
+ * their first word; a class may be used as many times as it has words.
+ */
+struct word_class {
+	word_id_t *wc_ids;	/* in word list order */
+	int wc_n;
+	int wc_len;
+	int wc_used;		/* times in the solution being built */
+};
+
+typedef struct class_set {
+	struct word_class *cl_classes;
+	int cl_nclasses;
+	word_id_t *cl_ids;	/* storage for every class's wc_ids */
+} class_set_t;
+
+/*
+ * Scored best-K search (-K). A solution is any set of words made from
+ * some of the letters, scored as the sum of its letter values (-T). The
+ * K best found so far are kept in a min-heap. Candidates are tried in
+ * decreasing score order, and a branch is cut as soon as the letters
+ * left (or, under -M, the words left times the best remaining word)
+ * cannot lift its score above the K-th best.
+ */
+#define MAX_BEST 1000
+
+struct best_entry {
+	int be_score;
+	int be_nwords;
+	word_id_t be_words[MAX_WORD_SIZE];
+};
+
+typedef struct best_k {
+	struct best_entry *bk_heap;	/* min-heap on be_score */
+	int bk_k;
+	int bk_n;
+} best_k_t;
+
+struct scored_word {
+	int sw_score;
+	word_id_t sw_id;
+};
+
+/*
+ * Constraints on the anagrams printed, enforced during the search so that
+ * branches that cannot satisfy them are cut early. Required and excluded
+ * words are kept as word IDs, NO_WORD if not in the dictionary.
+ */
+#define MAX_LISTED_WORDS 16
+#define MAX_KWORDS 8		/* most words -k will search for */
+
+typedef struct search_limits {
+	int sl_min_words;
+	int sl_max_words;	/* 0 for no limit */
+	int sl_min_len;
+	int sl_nrequired;
+	word_id_t sl_required[MAX_LISTED_WORDS];
+	int sl_nexcluded;
+	word_id_t sl_excluded[MAX_LISTED_WORDS];
+	int sl_shortest;	/* shortest and longest usable candidate */
+	int sl_longest;
+} search_limits_t;
+
+/*
+ * Parallel loading. The word database is mmap()ed and cut at line
+ * boundaries into one chunk per thread. Each thread decodes, normalizes,
+ * counts letters, encodes, hashes and sorts the words of its own chunk,
+ * works out their signatures and makes a tree node for every distinct
+ * key. The sorted runs of nodes are then merged pairwise, a thread per
+ * pair, and the last run is linked into a balanced tree in one pass
+ * without a single key comparison.
+ */
+#define MAX_LOAD_THREADS 64
+
+struct loaded_word {
+	size_t lw_form;		/* offset of the NUL terminated form in lc_pool */
+	size_t lw_key;		/* offset of the encoded key in lc_pool */
+	size_t lw_sig;		/* offset of the key's signature in lc_pool */
+	size_t lw_cps;		/* offset of the normalized letters in lc_cps */
+	int lw_len;		/* number of letters */
+	uint64_t lw_hash;	/* hash_word() of the key */
+	uint64_t lw_sig_hash;	/* hash_word() of the signature */
+	char *lw_pool;		/* lc_pool of the chunk, once it stops moving */
+};
+
+struct load_chunk {
+	const char *lc_start;
+	const char *lc_end;
+	struct cp_count *lc_table;	/* letters seen, CP_TABLE_SIZE entries */
+	int lc_used;
+	struct loaded_word *lc_words;
+	size_t lc_nwords;
+	size_t lc_words_size;
+	char *lc_pool;
+	size_t lc_pool_len;
+	size_t lc_pool_size;
+	uint32_t *lc_cps;
+	size_t lc_ncps;
+	size_t lc_cps_size;
+	struct loaded_word **lc_sorted;	/* lc_words in key order */
+	wnode_t **lc_nodes;		/* a node per key, in key order */
+	size_t lc_nnodes;
+	struct load_chunk *lc_merge;	/* later chunk to merge in, if any */
+};
+
+/* Normalization applied to dictionary words and to the input */
+#define NORM_FOLD_CASE		0x1	/* "Polish" and "polish" are one key */
+#define NORM_STRIP_MARKS	0x2	/* "café" and "cafe" are one key */
+
+/*
+ * Base letters for U+00C0 to U+017F, with '-' for letters left alone
+ * (ligatures and letters that are not a mark on a Latin base).
+ */
+static const char latin1_base[] =
+    "AAAAAA-CEEEEIIII-NOOOOO-OUUUUY--aaaaaa-ceeeeiiii-nooooo-ouuuuy-y";
+static const char latin_ext_a_base[] =
+    "AaAaAaCcCcCcCcDdDdEeEeEeEeEeGgGgGgGgHhHhIiIiIiIiIi--JjKk-LlLlLlL"
+    "lLlNnNnNn---OoOoOo--RrRrRrSsSsSsSsTtTtTtUuUuUuUuUuUuWwYyYZzZzZzs";
+
+/*
+ * Phase timing. Phases are timed with the monotonic clock to the
+ * nanosecond. With --repeat the query phases are run again against the
+ * loaded dictionary, keeping a sample per run, and reported as min,
+ * median and max.
+ */
+#define MAX_REPEAT 100000
+
+enum {
+	PHASE_LOAD,
+	PHASE_INDEX,
+	PHASE_COMBINATIONS,
+	PHASE_SORT,
+	PHASE_WORD_LIST,
+	PHASE_ANAGRAMS,
+	PHASE_QUERY,
+	PHASE_COUNT
+};
+
+struct phase {
+	const char *ph_name;
+	uint64_t *ph_samples;	/* nanoseconds */
+	int ph_nsamples;
+	int ph_size;
+};
+
+/*
+ * Per-query budgets (-D, -N, -n). Every step of the searches, from the
+ * permutations to the anagram backtracking, calls query_stopped(), which
+ * reads the clock only every BUDGET_CHECK_STEPS steps. Once a budget is
+ * spent, or cancel_query() is called from another thread or a signal
+ * handler, the searches unwind and the query ends with what it has found
+ * so far, flagged as truncated.
+ */
+#define BUDGET_CHECK_STEPS 4096
+
+enum {
+	STOP_NONE,
+	STOP_TIME,
+	STOP_STEPS,
+	STOP_RESULTS,
+	STOP_CANCEL,
+};
+
+typedef struct query_budget {
+	uint64_t qb_time;		/* nsec per query, 0 for no limit */
+	uint64_t qb_max_steps;		/* 0 for no limit */
+	uint64_t qb_max_results;	/* 0 for no limit */
+	uint64_t qb_deadline;		/* now_nsec() when time is up */
+	uint64_t qb_steps;
+	uint64_t qb_next_check;		/* qb_steps at the next clock read */
+	uint64_t qb_results;
+	int qb_stop;			/* STOP_*, why the query ended */
+	int qb_ntruncated;		/* queries that ended early */
+} query_budget_t;
+
 /* Globals */
+struct phase phases[PHASE_COUNT] = {
+	[PHASE_LOAD] = { .ph_name = "dictionary load" },
+	[PHASE_INDEX] = { .ph_name = "signature index" },
+	[PHASE_COMBINATIONS] = { .ph_name = "word combinations" },
+	[PHASE_SORT] = { .ph_name = "sort" },
+	[PHASE_WORD_LIST] = { .ph_name = "word list output" },
+	[PHASE_ANAGRAMS] = { .ph_name = "anagrams (with output)" },
+	[PHASE_QUERY] = { .ph_name = "whole query" },
+};
+alphabet_t alpha;
+int norm_flags = NORM_FOLD_CASE;
+int load_threads = 1;
 char copy[MAX_WORD_SIZE];
 tree_handle_t th;
-struct list *word_list_head = NULL;
+sig_index_t si;
+sig_trie_t trie;
+char *word_pool;
+uint32_t *word_offs;		/* word ID -> offset in word_pool */
+uint8_t *word_lens;
+wnode_t **word_nodes;
+uint32_t *word_seen;		/* word ID -> seen_stamp if in word_list */
+uint32_t seen_stamp = 1;
+word_list_t word_list;
 int stack_top;
-char *stack[MAX_WORD_SIZE];
+word_id_t stack[MAX_WORD_SIZE];
+uint64_t search_nodes;
+uint64_t tree_visits;		/* -t: tree nodes looked at */
+uint64_t class_solutions;	/* -g: solutions printed */
+uint64_t class_anagrams;	/* -g: anagrams they stand for */
+search_limits_t limits;
+query_budget_t budget;
+int letter_value[MAX_LETTERS + 1];	/* per letter code, for -K */
+int *word_scores;			/* word ID -> score, for -K */
+volatile sig_atomic_t cancel_requested;	/* set by cancel_query() */
 
 int
 str_compare(const void *query_key, const void *cur)
@@ -50,17 +438,71 @@ str_compare(const void *query_key, const void *cur)
 	}
 }
 
+/* Recompute the subtree summary of node; returns 1 if it changed */
+int
+word_node_update(wnode_t *node)
+{
+	wnode_t *child[2];
+	uint32_t need = node->mask;
+	int i, min_len = node->len;
+
+	child[0] = RB_LEFT(node, rb_node);
+	child[1] = RB_RIGHT(node, rb_node);
+	for (i = 0; i < 2; i++) {
+		if (child[i] == NULL) {
+			continue;
+		}
+		need &= child[i]->sub_need;
+		if (child[i]->sub_min_len < min_len) {
+			min_len = child[i]->sub_min_len;
+		}
+	}
+	if (need == node->sub_need && min_len == node->sub_min_len) {
+		return (0);
+	}
+	node->sub_need = need;
+	node->sub_min_len = min_len;
+	return (1);
+}
+
+/*
+ * RB_AUGMENT() hook, called on a node whose children changed. Recompute
+ * its subtree summary and carry the change up; once a node's summary is
+ * unchanged, so are those of its ancestors.
+ */
+void
+word_node_augment(wnode_t *node)
+{
+	for (; node && word_node_update(node);
+	    node = RB_PARENT(node, rb_node))
+		;
+}
+
 RB_PROTOTYPE(word_tree, word_node, rb_node, str_compare);
 RB_GENERATE(word_tree, word_node, rb_node, str_compare);
 
 
-wnode_t *get_tree_node(char *str)
+/* The word of a node holds the key followed by its signature, sig */
+wnode_t *get_tree_node(char *str, char *sig)
 {
 	wnode_t *w = ((wnode_t *) malloc(sizeof(wnode_t)));
+	int len = strlen(str);
+	char *p;
+
 	if (w) {
-		w->word = malloc(strlen(str));
+		w->word = malloc(2 * (len + 1));
 		if (w->word) {
-			strcpy(w->word, str);
+			memcpy(w->word, str, len + 1);
+			memcpy(w->word + len + 1, sig, len + 1);
+			w->forms = NULL;
+			w->sig_next = NULL;
+			w->mask = 0;
+			for (p = str; *p != '\0'; p++) {
+				w->mask |= LETTER_BIT((uint8_t)*p);
+			}
+			w->len = len;
+			w->sub_need = w->mask;
+			w->sub_min_len = w->len;
 		} else {
 			perror("malloc");
 			exit(1);
@@ -72,469 +514,3046 @@ wnode_t *get_tree_node(char *str)
 	return (w);
 }
 
+struct list *get_wlist_node(char *str);
+
+uint64_t
+hash_word(const char *str)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	/* FNV-1a followed by a murmur3 style finalizer to spread the bits */
+	for (; *str != '\0'; str++) {
+		h ^= (unsigned char)*str;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+/*
+ * The upper 32 bits of the hash pick the block, the lower 32 bits give
+ * the BLOOM_K bit positions within it by double hashing.
+ */
+struct bloom_block *
+bloom_block_of(bloom_filter_t *bf, uint64_t h)
+{
+	return (&bf->bf_blocks[((h >> 32) * bf->bf_nblocks) >> 32]);
+}
+
 void
-init_tree(tree_handle_t *handle)
+bloom_add_hash(bloom_filter_t *bf, uint64_t h)
 {
-	RB_INIT(&handle->th_tree);
+	struct bloom_block *b = bloom_block_of(bf, h);
+	uint32_t h1 = h & 0xffff, h2 = ((h >> 16) & 0xffff) | 1;
+	int i, bit;
+
+	for (i = 0; i < BLOOM_K; i++) {
+		bit = (h1 + i * h2) & 511;
+		b->bb_bits[bit >> 6] |= 1ULL << (bit & 63);
+	}
 }
 
+/* Returns 0 if str may be in the tree, ENOENT if it definitely is not */
 int
-add_word_to_tree(tree_handle_t *handle, char *add_str)
+bloom_check(bloom_filter_t *bf, const char *str)
+{
+	uint64_t h = hash_word(str);
+	struct bloom_block *b = bloom_block_of(bf, h);
+	uint32_t h1 = h & 0xffff, h2 = ((h >> 16) & 0xffff) | 1;
+	int i, bit;
+
+	for (i = 0; i < BLOOM_K; i++) {
+		bit = (h1 + i * h2) & 511;
+		if ((b->bb_bits[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+			return (ENOENT);
+		}
+	}
+	return (0);
+}
+
+void
+build_bloom_filter(tree_handle_t *handle)
 {
+	bloom_filter_t *bf = &handle->th_bloom;
 	wnode_t *node;
-	int ret = 0;
+	size_t bytes;
+
+	bf->bf_nblocks = ((uint64_t)handle->th_nwords * BLOOM_BITS_PER_WORD +
+	    511) / 512;
+	if (bf->bf_nblocks == 0) {
+		bf->bf_nblocks = 1;
+	}
+	bytes = bf->bf_nblocks * sizeof(struct bloom_block);
+	bf->bf_blocks = aligned_alloc(sizeof(struct bloom_block), bytes);
+	if (bf->bf_blocks == NULL) {
+		perror("aligned_alloc");
+		exit(1);
+	}
+	memset(bf->bf_blocks, 0, bytes);
 
-	ASSERT(add_str != NULL);
+	RB_FOREACH(node, word_tree, &handle->th_tree) {
+		bloom_add_hash(bf, node->hash);
+	}
+}
+
+void
+print_bloom_stats(bloom_filter_t *bf)
+{
+	uint64_t misses = bf->bf_rejects + bf->bf_false_pos;
+
+	fprintf(stderr, "bloom filter : %lu bytes, %lu probes, %lu hits "
+	    "(%.2f%%), %lu rejected by filter, false positive rate %.4f%%\n",
+	    bf->bf_nblocks * sizeof(struct bloom_block), bf->bf_probes,
+	    bf->bf_hits, bf->bf_probes ?
+	    100.0 * bf->bf_hits / bf->bf_probes : 0.0, bf->bf_rejects,
+	    misses ? 100.0 * bf->bf_false_pos / misses : 0.0);
+}
+
+void
+init_tree(tree_handle_t *handle)
+{
+	RB_INIT(&handle->th_tree);
+	handle->th_nwords = 0;
+	memset(&handle->th_bloom, 0, sizeof(bloom_filter_t));
+}
 
-	node = get_tree_node(add_str);
+/*
+ * Add the surface form "form" to node, after its other forms. Returns
+ * EEXIST if node already has this exact form.
+ */
+int
+add_form(wnode_t *node, char *form)
+{
+	struct list *f, *last = NULL;
 
-	if (RB_FIND(word_tree, &handle->th_tree, node) != NULL) {
-		/* Node already present */
-		free(node);
-		ret = EEXIST;
+	for (f = node->forms; f; last = f, f = f->next) {
+		if (strcmp(f->word, form) == 0) {
+			return (EEXIST);
+		}
+	}
+	if (last) {
+		last->next = get_wlist_node(form);
 	} else {
-		RB_INSERT(word_tree, &handle->th_tree, (void *)node);
+		node->forms = get_wlist_node(form);
 	}
+	return (0);
+}
 
-	return (ret);
+/*
+ * Move the forms of src, a node with the same key from later in the
+ * file, to the end of those of dst, dropping any dst already has.
+ */
+void
+merge_forms(wnode_t *dst, wnode_t *src)
+{
+	struct list *f, *d, *next, **tail;
+
+	for (tail = &dst->forms; *tail; tail = &(*tail)->next)
+		;
+	for (f = src->forms; f; f = next) {
+		next = f->next;
+		for (d = dst->forms; d; d = d->next) {
+			if (strcmp(d->word, f->word) == 0) {
+				break;
+			}
+		}
+		if (d) {
+			fprintf(stderr, "%s already in tree\n", f->word);
+			free(f->word);
+			free(f);
+			continue;
+		}
+		f->next = NULL;
+		*tail = f;
+		tail = &f->next;
+	}
+	src->forms = NULL;
 }
 
-int
-search_word_in_tree(tree_handle_t *handle, char *search_str)
+wnode_t *
+find_word_in_tree(tree_handle_t *handle, char *search_str)
 {
 	wnode_t temp, *node;
-	int ret;
+
+	handle->th_bloom.bf_probes++;
+	if (bloom_check(&handle->th_bloom, search_str) != 0) {
+		handle->th_bloom.bf_rejects++;
+		return (NULL);
+	}
 
 	memset((void *)&temp, 0, sizeof(wnode_t));
 	temp.word = search_str;
 
 	if ((node = RB_FIND(word_tree, &handle->th_tree, &temp)) != NULL) {
 		/* Found */
-		ret = 0;
+		handle->th_bloom.bf_hits++;
 	} else {
 		/* Not Found */
-		ret = ENOENT;
+		handle->th_bloom.bf_false_pos++;
 	}
 
-	return (ret);
+	return (node);
 }
 
 int
-populate_tree(tree_handle_t *tree)
+search_word_in_tree(tree_handle_t *handle, char *search_str)
 {
-	/* Assumption : no word in the WORD_DB is >= MAX_WORD_SIZE characters long */
-	FILE *fp;
-	char temp[MAX_WORD_SIZE];
+	return (find_word_in_tree(handle, search_str) ? 0 : ENOENT);
+}
 
-	fp = fopen(WORD_DB, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "Could not open word database at : %s\n",
-		    WORD_DB);
-		exit(1);
+/*
+ * Decode one UTF-8 sequence at *sp into *cp and advance *sp past it.
+ * Returns -1 on a malformed sequence.
+ */
+int
+utf8_decode(const char **sp, uint32_t *cp)
+{
+	const unsigned char *s = (const unsigned char *)*sp;
+	int n, i;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		n = 1;
+	} else if ((s[0] & 0xe0) == 0xc0) {
+		*cp = s[0] & 0x1f;
+		n = 2;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		*cp = s[0] & 0x0f;
+		n = 3;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		*cp = s[0] & 0x07;
+		n = 4;
+	} else {
+		return (-1);
+	}
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return (-1);
+		}
+		*cp = (*cp << 6) | (s[i] & 0x3f);
+	}
+	if (*cp < 0x80 && n > 1) {
+		/* Overlong encoding */
+		return (-1);
+	}
+	*sp += n;
+	return (0);
+}
+
+int
+utf8_encode(uint32_t cp, char *out)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return (1);
+	} else if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return (2);
+	} else if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return (3);
+	}
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return (4);
+}
+
+int
+is_letter(uint32_t cp)
+{
+	if (cp < 0x80) {
+		return (isalpha(cp));
+	}
+	return (iswalpha((wint_t)cp));
+}
+
+/* Returns 0 if str is valid UTF-8 made up of letters only */
+int
+validate_input(char *str)
+{
+	const char *p = str;
+	uint32_t cp;
+
+	while (*p != '\0') {
+		if (utf8_decode(&p, &cp) != 0 || !is_letter(cp)) {
+			return (1);
+		}
 	}
+	return (0);
+}
+
+/*
+ * Decode str into its normalized letters in cps[] according to
+ * norm_flags. Apostrophes are dropped so that "don't" is looked up as
+ * "dont". Returns the number of letters, or -1 if str is not valid UTF-8,
+ * has something other than letters, or is too long.
+ */
+int
+normalize_word(const char *str, uint32_t *cps)
+{
+	uint32_t cp;
+	int n = 0;
+	char base = '-';
 
-	while(fscanf(fp, "%s", temp) != EOF) {
-		if (add_word_to_tree(tree, temp) == EEXIST) {
-			fprintf(stderr, "%s already in tree\n", temp);
+	while (*str != '\0') {
+		if (utf8_decode(&str, &cp) != 0) {
+			return (-1);
+		}
+		if (cp == '\'' || cp == 0x2019) {
+			continue;
+		}
+		if (!is_letter(cp) || n == MAX_WORD_SIZE - 1) {
+			return (-1);
+		}
+		if (norm_flags & NORM_STRIP_MARKS) {
+			if (cp >= 0xc0 && cp < 0x100) {
+				base = latin1_base[cp - 0xc0];
+			} else if (cp >= 0x100 && cp < 0x180) {
+				base = latin_ext_a_base[cp - 0x100];
+			} else {
+				base = '-';
+			}
+			if (base != '-') {
+				cp = base;
+			}
+		}
+		if (norm_flags & NORM_FOLD_CASE) {
+			cp = (cp < 0x80) ? tolower(cp) : towlower((wint_t)cp);
 		}
+		cps[n++] = cp;
 	}
+	return (n);
+}
 
-	fclose(fp);
+/* Code for code point cp, or 0 if the dictionary never uses it */
+int
+alpha_code(alphabet_t *al, uint32_t cp)
+{
+	int lo = 1, hi = al->al_nletters, mid;
+
+	if (cp < 128) {
+		return (al->al_ascii[cp]);
+	}
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (al->al_cp[mid] == cp) {
+			return (mid);
+		} else if (al->al_cp[mid] < cp) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
 	return (0);
 }
 
+/*
+ * Normalize the UTF-8 string str and translate it into letter codes in
+ * out. Returns the number of letters, or -1 if str cannot be normalized
+ * or has a letter outside the alphabet.
+ */
 int
-query_word_from_user(char *temp)
+encode_word(alphabet_t *al, const char *str, char *out)
 {
-	int i;
-	printf("Enter jumbled word: ");
-	fflush(stdin);
-	fgets(temp, MAX_WORD_SIZE, stdin);
-	/* fgets() reads the newline into the buffer. Remove if present */
-	for (i = 0; i < strlen(temp); i++) {
-		if (temp[i] == '\n') {
-			temp[i] = '\0';
+	uint32_t cps[MAX_WORD_SIZE];
+	int i, n, code;
+
+	if ((n = normalize_word(str, cps)) <= 0) {
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		if ((code = alpha_code(al, cps[i])) == 0) {
+			return (-1);
+		}
+		out[i] = code;
+	}
+	out[n] = '\0';
+	return (n);
+}
+
+/* Translate the letter codes in enc back to UTF-8. out must hold 4x */
+char *
+decode_word(alphabet_t *al, const char *enc, char *out)
+{
+	char *p = out;
+
+	for (; *enc != '\0'; enc++) {
+		p += utf8_encode(al->al_cp[(uint8_t)*enc], p);
+	}
+	*p = '\0';
+	return (out);
+}
+
+/* Count one occurrence of letter cp in a CP_TABLE_SIZE table */
+void
+count_letter(struct cp_count *table, int *used, uint32_t cp, uint64_t n)
+{
+	int j;
+
+	for (j = (cp * 2654435761u) % CP_TABLE_SIZE;
+	    table[j].cc_count && table[j].cc_cp != cp;
+	    j = (j + 1) % CP_TABLE_SIZE)
+		;
+	if (table[j].cc_count == 0) {
+		if (++(*used) > MAX_LETTERS - 1) {
+			fprintf(stderr, "Dictionary uses more than %d letters\n",
+			    MAX_LETTERS - 1);
+			exit(1);
+		}
+		table[j].cc_cp = cp;
+	}
+	table[j].cc_count += n;
+}
+
+/*
+ * Merge the letters seen by every chunk and give each a dense code, in
+ * code point order.
+ */
+void
+assign_letter_codes(alphabet_t *al, struct load_chunk *chunks, int nchunks)
+{
+	struct cp_count *table, t;
+	int c, i, j, used = 0;
+
+	table = calloc(CP_TABLE_SIZE, sizeof(struct cp_count));
+	if (table == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (c = 0; c < nchunks; c++) {
+		for (i = 0; i < CP_TABLE_SIZE; i++) {
+			if (chunks[c].lc_table[i].cc_count) {
+				count_letter(table, &used,
+				    chunks[c].lc_table[i].cc_cp,
+				    chunks[c].lc_table[i].cc_count);
+			}
 		}
 	}
+
+	/* Pack the used entries to the front, sorted by code point */
+	for (i = j = 0; i < CP_TABLE_SIZE; i++) {
+		if (table[i].cc_count) {
+			table[j++] = table[i];
+		}
+	}
+	for (i = 1; i < used; i++) {
+		t = table[i];
+		for (j = i; j > 0 && table[j - 1].cc_cp > t.cc_cp; j--) {
+			table[j] = table[j - 1];
+		}
+		table[j] = t;
+	}
+
+	memset(al, 0, sizeof(alphabet_t));
+	al->al_nletters = used;
+	for (i = 0; i < used; i++) {
+		al->al_cp[i + 1] = table[i].cc_cp;
+		al->al_freq[i + 1] = table[i].cc_count;
+		if (table[i].cc_cp < 128) {
+			al->al_ascii[table[i].cc_cp] = i + 1;
+		}
+	}
+	free(table);
+}
+
+/* Make room for need more elements of size elem in the array at *p */
+void
+grow_array(void **p, size_t *size, size_t len, size_t need, size_t elem)
+{
+	if (len + need <= *size) {
+		return;
+	}
+	while (len + need > *size) {
+		*size = *size ? *size * 2 : 4096;
+	}
+	*p = realloc(*p, *size * elem);
+	if (*p == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+}
+
+/*
+ * Load pass 1, run on each chunk: split it into words, normalize them and
+ * count the letters used. Words that contain anything but letters and
+ * apostrophes can never be formed from validated input and are dropped.
+ */
+void *
+scan_chunk(void *arg)
+{
+	struct load_chunk *lc = arg;
+	struct loaded_word *lw;
+	uint32_t cps[MAX_WORD_SIZE];
+	char temp[MAX_WORD_SIZE];
+	const char *p = lc->lc_start, *w;
+	int i, n, len;
+
+	lc->lc_table = calloc(CP_TABLE_SIZE, sizeof(struct cp_count));
+	if (lc->lc_table == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while (p < lc->lc_end) {
+		for (; p < lc->lc_end && isspace((unsigned char)*p); p++)
+			;
+		for (w = p; p < lc->lc_end && !isspace((unsigned char)*p); p++)
+			;
+		len = p - w;
+		if (len == 0 || len >= MAX_WORD_SIZE) {
+			continue;
+		}
+		memcpy(temp, w, len);
+		temp[len] = '\0';
+		if ((n = normalize_word(temp, cps)) <= 0) {
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			count_letter(lc->lc_table, &lc->lc_used, cps[i], 1);
+		}
+
+		grow_array((void **)&lc->lc_words, &lc->lc_words_size,
+		    lc->lc_nwords, 1, sizeof(struct loaded_word));
+		grow_array((void **)&lc->lc_pool, &lc->lc_pool_size,
+		    lc->lc_pool_len, len + 1 + 2 * (n + 1), 1);
+		grow_array((void **)&lc->lc_cps, &lc->lc_cps_size,
+		    lc->lc_ncps, n, sizeof(uint32_t));
+
+		lw = &lc->lc_words[lc->lc_nwords++];
+		lw->lw_form = lc->lc_pool_len;
+		memcpy(lc->lc_pool + lc->lc_pool_len, temp, len + 1);
+		lc->lc_pool_len += len + 1;
+		/* The key and signature follow the form, filled in by pass 2 */
+		lw->lw_key = lc->lc_pool_len;
+		lc->lc_pool_len += n + 1;
+		lw->lw_sig = lc->lc_pool_len;
+		lc->lc_pool_len += n + 1;
+		lw->lw_cps = lc->lc_ncps;
+		memcpy(lc->lc_cps + lc->lc_ncps, cps, n * sizeof(uint32_t));
+		lc->lc_ncps += n;
+		lw->lw_len = n;
+	}
+	return (NULL);
+}
+
+/* Order loaded words by key, and by position in the file for equal keys */
+int
+loaded_word_compare(const void *a, const void *b)
+{
+	const struct loaded_word *x = *(struct loaded_word **)a;
+	const struct loaded_word *y = *(struct loaded_word **)b;
+	int cmp;
+
+	/* The pool offset is unique to a word and grows along the file */
+	cmp = strcmp(x->lw_pool + x->lw_key, y->lw_pool + y->lw_key);
+	if (cmp == 0) {
+		cmp = (x->lw_form < y->lw_form) ? -1 : 1;
+	}
+	return (cmp);
+}
+
+void get_signature(char *word, char *sig);
+
+/*
+ * Make a tree node for every distinct key of a sorted chunk, with the
+ * forms of the key in file order, and drop the per-word load data.
+ */
+void
+make_chunk_nodes(struct load_chunk *lc)
+{
+	struct loaded_word *lw;
+	wnode_t *node = NULL;
+	size_t w;
+
+	lc->lc_nodes = malloc((lc->lc_nwords + 1) * sizeof(wnode_t *));
+	if (lc->lc_nodes == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (w = 0; w < lc->lc_nwords; w++) {
+		lw = lc->lc_sorted[w];
+		if (node == NULL ||
+		    strcmp(node->word, lc->lc_pool + lw->lw_key) != 0) {
+			node = get_tree_node(lc->lc_pool + lw->lw_key,
+			    lc->lc_pool + lw->lw_sig);
+			node->hash = lw->lw_hash;
+			node->sig_hash = lw->lw_sig_hash;
+			lc->lc_nodes[lc->lc_nnodes++] = node;
+		}
+		if (add_form(node, lc->lc_pool + lw->lw_form) == EEXIST) {
+			fprintf(stderr, "%s already in tree\n",
+			    lc->lc_pool + lw->lw_form);
+		}
+	}
+	free(lc->lc_sorted);
+	free(lc->lc_words);
+	free(lc->lc_pool);
+	lc->lc_sorted = NULL;
+	lc->lc_words = NULL;
+	lc->lc_pool = NULL;
+}
+
+/*
+ * Load pass 2, run on each chunk once the alphabet is known: encode the
+ * normalized words into keys, hash them, work out their signatures, sort
+ * them by key and make their tree nodes.
+ */
+void *
+encode_chunk(void *arg)
+{
+	struct load_chunk *lc = arg;
+	struct loaded_word *lw;
+	char *key, *sig;
+	size_t w;
+	int i;
+
+	lc->lc_sorted = malloc((lc->lc_nwords + 1) *
+	    sizeof(struct loaded_word *));
+	if (lc->lc_sorted == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (w = 0; w < lc->lc_nwords; w++) {
+		lw = &lc->lc_words[w];
+		key = lc->lc_pool + lw->lw_key;
+		for (i = 0; i < lw->lw_len; i++) {
+			key[i] = alpha_code(&alpha, lc->lc_cps[lw->lw_cps + i]);
+		}
+		key[i] = '\0';
+		lw->lw_hash = hash_word(key);
+		sig = lc->lc_pool + lw->lw_sig;
+		get_signature(key, sig);
+		lw->lw_sig_hash = hash_word(sig);
+		lw->lw_pool = lc->lc_pool;
+		lc->lc_sorted[w] = lw;
+	}
+	free(lc->lc_cps);
+	lc->lc_cps = NULL;
+	qsort(lc->lc_sorted, lc->lc_nwords, sizeof(struct loaded_word *),
+	    loaded_word_compare);
+	make_chunk_nodes(lc);
+	return (NULL);
+}
+
+/*
+ * Load pass 3, run on pairs of chunks: merge the nodes of lc->lc_merge, a
+ * later chunk, into those of lc. A key found in both keeps the node of lc,
+ * with the later forms after its own.
+ */
+void *
+merge_chunk(void *arg)
+{
+	struct load_chunk *lc = arg, *later = lc->lc_merge;
+	wnode_t **nodes, **a, **a_end, **b, **b_end;
+	size_t n = 0;
+	int cmp;
+
+	if (later == NULL) {
+		return (NULL);
+	}
+	nodes = malloc((lc->lc_nnodes + later->lc_nnodes + 1) *
+	    sizeof(wnode_t *));
+	if (nodes == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	a = lc->lc_nodes;
+	a_end = a + lc->lc_nnodes;
+	b = later->lc_nodes;
+	b_end = b + later->lc_nnodes;
+	while (a < a_end && b < b_end) {
+		cmp = strcmp((*a)->word, (*b)->word);
+		if (cmp > 0) {
+			nodes[n++] = *b++;
+			continue;
+		}
+		if (cmp == 0) {
+			merge_forms(*a, *b);
+			free((*b)->word);
+			free(*b);
+			b++;
+		}
+		nodes[n++] = *a++;
+	}
+	for (; a < a_end; a++) {
+		nodes[n++] = *a;
+	}
+	for (; b < b_end; b++) {
+		nodes[n++] = *b;
+	}
+	free(lc->lc_nodes);
+	free(later->lc_nodes);
+	lc->lc_nodes = nodes;
+	lc->lc_nnodes = n;
+	lc->lc_merge = NULL;
+	later->lc_nodes = NULL;
+	later->lc_nnodes = 0;
+	return (NULL);
+}
+
+/* Run fn on every stride'th chunk, one thread each */
+void
+run_on_chunks(void *(*fn)(void *), struct load_chunk *chunks, int nchunks,
+    int stride)
+{
+	pthread_t threads[MAX_LOAD_THREADS];
+	int c;
+
+	for (c = stride; c < nchunks; c += stride) {
+		if (pthread_create(&threads[c], NULL, fn, &chunks[c]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	fn(&chunks[0]);
+	for (c = stride; c < nchunks; c += stride) {
+		pthread_join(threads[c], NULL);
+	}
+}
+
+/*
+ * Link the sorted nodes[lo, hi) into a balanced subtree below parent and
+ * return its root. Every level but the deepest, red_depth, is full, so
+ * making that level red and the others black meets the red-black rules.
+ */
+wnode_t *
+link_nodes(wnode_t **nodes, size_t lo, size_t hi, wnode_t *parent,
+    int depth, int red_depth)
+{
+	wnode_t *node;
+	size_t mid;
+
+	if (lo == hi) {
+		return (NULL);
+	}
+	mid = lo + (hi - lo) / 2;
+	node = nodes[mid];
+	RB_PARENT(node, rb_node) = parent;
+	RB_LEFT(node, rb_node) = link_nodes(nodes, lo, mid, node, depth + 1,
+	    red_depth);
+	RB_RIGHT(node, rb_node) = link_nodes(nodes, mid + 1, hi, node,
+	    depth + 1, red_depth);
+	RB_COLOR(node, rb_node) = (depth > 0 && depth == red_depth) ?
+	    RB_RED : RB_BLACK;
+	word_node_update(node);
+	return (node);
+}
+
+/*
+ * Move the keys and their signatures into word_pool in tree order and
+ * number them. The tree nodes are left pointing at the pooled keys.
+ */
+void
+intern_words(tree_handle_t *tree)
+{
+	size_t size = 0, off = 0;
+	word_id_t id = 0;
+	wnode_t *node;
+	int len;
+
+	RB_FOREACH(node, word_tree, &tree->th_tree) {
+		size += 2 * (node->len + 1);
+	}
+	word_pool = malloc(size ? size : 1);
+	word_offs = malloc((tree->th_nwords + 1) * sizeof(uint32_t));
+	word_lens = malloc(tree->th_nwords + 1);
+	word_nodes = malloc((tree->th_nwords + 1) * sizeof(wnode_t *));
+	word_seen = calloc(tree->th_nwords + 1, sizeof(uint32_t));
+	if (!word_pool || !word_offs || !word_lens || !word_nodes ||
+	    !word_seen) {
+		perror("malloc");
+		exit(1);
+	}
+
+	RB_FOREACH(node, word_tree, &tree->th_tree) {
+		len = node->len;
+		memcpy(word_pool + off, node->word, 2 * (len + 1));
+		free(node->word);
+		node->word = word_pool + off;
+		node->id = id;
+		word_offs[id] = off;
+		word_lens[id] = len;
+		word_nodes[id] = node;
+		off += 2 * (len + 1);
+		id++;
+	}
+}
+
+void
+wl_add(word_list_t *wl, word_id_t id)
+{
+	if (wl->wl_n == wl->wl_size) {
+		wl->wl_size = wl->wl_size ? wl->wl_size * 2 : 64;
+		wl->wl_ids = realloc(wl->wl_ids, wl->wl_size *
+		    sizeof(word_id_t));
+		if (wl->wl_ids == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	wl->wl_ids[wl->wl_n++] = id;
+}
+
+void
+wl_free(word_list_t *wl)
+{
+	free(wl->wl_ids);
+	memset(wl, 0, sizeof(word_list_t));
+}
+
+int
+populate_tree(tree_handle_t *tree)
+{
+	struct load_chunk chunks[MAX_LOAD_THREADS];
+	struct stat st;
+	const char *map, *p;
+	size_t size;
+	int fd, c, step, red_depth, nchunks = load_threads;
+
+	fd = open(WORD_DB, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Could not open word database at : %s\n",
+		    WORD_DB);
+		exit(1);
+	}
+	size = st.st_size;
+	map = "";
+	if (size != 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+	}
+	if (size == 0) {
+		nchunks = 1;
+	}
+
+	/* Cut the file into chunks, each ending just after a newline */
+	memset(chunks, 0, sizeof(chunks));
+	for (c = 0, p = map; c < nchunks; c++) {
+		chunks[c].lc_start = p;
+		if (c == nchunks - 1) {
+			p = map + size;
+		} else {
+			p = map + size * (c + 1) / nchunks;
+			if (p < chunks[c].lc_start) {
+				p = chunks[c].lc_start;
+			}
+			for (; p < map + size && *p != '\n'; p++)
+				;
+			if (p < map + size) {
+				p++;
+			}
+		}
+		chunks[c].lc_end = p;
+	}
+
+	run_on_chunks(scan_chunk, chunks, nchunks, 1);
+	assign_letter_codes(&alpha, chunks, nchunks);
+	run_on_chunks(encode_chunk, chunks, nchunks, 1);
+
+	/*
+	 * Merge the sorted runs pairwise until one is left. The earlier chunk
+	 * of a pair takes in the later one, so the surface forms of a key stay
+	 * in file order.
+	 */
+	for (step = 1; step < nchunks; step *= 2) {
+		for (c = 0; c + step < nchunks; c += 2 * step) {
+			chunks[c].lc_merge = &chunks[c + step];
+		}
+		run_on_chunks(merge_chunk, chunks, nchunks, 2 * step);
+	}
+
+	tree->th_nwords = chunks[0].lc_nnodes;
+	for (red_depth = 0; ((size_t)2 << red_depth) <= tree->th_nwords;
+	    red_depth++)
+		;
+	RB_ROOT(&tree->th_tree) = link_nodes(chunks[0].lc_nodes, 0,
+	    chunks[0].lc_nnodes, NULL, 0, red_depth);
+	free(chunks[0].lc_nodes);
+	for (c = 0; c < nchunks; c++) {
+		free(chunks[c].lc_table);
+	}
+
+	if (size != 0) {
+		munmap((void *)map, size);
+	}
+	close(fd);
+	build_bloom_filter(tree);
+	intern_words(tree);
+	return (0);
+}
+
+int
+query_word_from_user(char *temp)
+{
+	int i;
+	printf("Enter jumbled word: ");
+	fflush(stdin);
+	fgets(temp, MAX_WORD_SIZE, stdin);
+	/* fgets() reads the newline into the buffer. Remove if present */
+	for (i = 0; i < strlen(temp); i++) {
+		if (temp[i] == '\n') {
+			temp[i] = '\0';
+		}
+	}
+}
+
+void __attribute__((always_inline))
+swap(char *a, char *b)
+{
+	int t;
+
+	t = *a;
+	*a = *b;
+	*b = t;
+}
+
+uint64_t now_nsec(void);
+
+/* Ask the running query to stop; safe from other threads and signals */
+void
+cancel_query(void)
+{
+	__atomic_store_n(&cancel_requested, 1, __ATOMIC_RELAXED);
+}
+
+void
+sigint_handler(int sig)
+{
+	(void)sig;
+	cancel_query();
+}
+
+void
+start_budget(void)
+{
+	/* A cancel only ends the query it arrived during */
+	__atomic_store_n(&cancel_requested, 0, __ATOMIC_RELAXED);
+	budget.qb_steps = 0;
+	budget.qb_results = 0;
+	budget.qb_stop = STOP_NONE;
+	budget.qb_deadline = now_nsec() + budget.qb_time;
+	budget.qb_next_check = BUDGET_CHECK_STEPS;
+	if (budget.qb_max_steps && budget.qb_max_steps < BUDGET_CHECK_STEPS) {
+		budget.qb_next_check = budget.qb_max_steps;
+	}
+}
+
+int
+check_budget(void)
+{
+	if (budget.qb_max_steps && budget.qb_steps >= budget.qb_max_steps) {
+		budget.qb_stop = STOP_STEPS;
+	} else if (budget.qb_time && now_nsec() >= budget.qb_deadline) {
+		budget.qb_stop = STOP_TIME;
+	}
+	budget.qb_next_check = budget.qb_steps + BUDGET_CHECK_STEPS;
+	if (budget.qb_max_steps && budget.qb_next_check > budget.qb_max_steps) {
+		budget.qb_next_check = budget.qb_max_steps;
+	}
+	return (budget.qb_stop != STOP_NONE);
+}
+
+/* Count a search step; returns 1 if the query has to stop */
+int
+query_stopped(void)
+{
+	if (budget.qb_stop != STOP_NONE) {
+		return (1);
+	}
+	if (__atomic_load_n(&cancel_requested, __ATOMIC_RELAXED)) {
+		budget.qb_stop = STOP_CANCEL;
+		return (1);
+	}
+	if (++budget.qb_steps >= budget.qb_next_check) {
+		return (check_budget());
+	}
+	return (0);
+}
+
+/* Count a printed solution against the result budget */
+void
+count_result(void)
+{
+	budget.qb_results++;
+	if (budget.qb_max_results &&
+	    budget.qb_results >= budget.qb_max_results) {
+		budget.qb_stop = STOP_RESULTS;
+	}
+}
+
+/* Flag a query that ended early; its output so far is all there is */
+void
+end_budget(void)
+{
+	static const char *reasons[] = {
+		[STOP_TIME] = "time limit reached",
+		[STOP_STEPS] = "step limit reached",
+		[STOP_RESULTS] = "result limit reached",
+		[STOP_CANCEL] = "cancelled",
+	};
+
+	if (budget.qb_stop != STOP_NONE) {
+		printf("\n\nSearch truncated : %s\n", reasons[budget.qb_stop]);
+		budget.qb_ntruncated++;
+	}
+}
+
+struct list *
+get_wlist_node(char *str)
+{
+	struct list *temp = malloc(sizeof(struct list));
+	if (temp) {
+		temp->word = malloc(strlen(str) + 1);
+		if (temp->word) {
+			strcpy(temp->word, str);
+			temp->next = NULL;
+		} else {
+			perror("malloc");
+			exit(1);
+		}
+	} else {
+		perror("malloc");
+		exit(1);
+	}
+	return (temp);
+}
+
+int
+add_to_word_list(word_id_t id)
+{
+	if (word_seen[id] == seen_stamp) {
+		/* Found */
+		return EEXIST;
+	}
+
+	/* New word. Add to list */
+	word_seen[id] = seen_stamp;
+	wl_add(&word_list, id);
+	return (0);
+}
+
+/*
+ * The recursive algorithm below does the following:
+ * Lets take the letter combination - abc
+ *
+ * It starts off by producing all possible permutations starting with 'a'.
+ * This is done by keeping 'a' unchanged and calling get_all_permutations
+ * (recursively) with an advanced pointer (p+1). Note that the changes are being
+ * done in-place and hence the input string is getting modified with each swap.
+ * So, at the end of all iterations, get_all_permutations() makes sure that it
+ * returns the input string to its initial state.
+ *
+ * In the above example, the following is the call stack():
+ * We use the short form g_a_c() to represent get_all_permutations().
+ * g_a_c(abc, 3)
+ *   g_a_c(bc, 2)
+ *     g_a_c(c, 1) -> Print 'abc'
+ *   i is 0 here, which is less than (len - 1) => (2 - 1)
+ *   swap elem0 with elem1 => b with c. String becomes cb
+ *   g_a_c(cb, 2)
+ *     g_a_c(b, 1) -> Print 'acb'
+ *   i is 1 here which is NOT less than (2 - 1). Time to restore the string to
+ *   its original position
+ *   Rotate the current string to the left once to get back to the initial
+ *   state.
+ *   String no becomes 'bc'.
+ *
+ * After all the permutations starting with 'a', it brings the next letter in
+ * the input string to the 0th place by swapping it with what was there
+ * already. In this case, 'b' is swapped with 'a'. Now, the string becomes
+ * 'bac'. It agains gets all permutations starting with 'b'. This way, it goes
+ * all the way until all the for the last letter is obtained.
+ */
+
+void
+get_all_permutations(char *p, int len)
+{
+	int i, t;
+
+	if (query_stopped()) {
+		return;
+	}
+	if (len == 1) {
+		char *q;
+		wnode_t *node;
+		/*
+		 * Probe every suffix of the current permutation. Single
+		 * letters count only if the dictionary has them as words.
+		 */
+		for (q = copy; *q != '\0'; q++) {
+			if ((node = find_word_in_tree(&th, q)) != NULL) {
+				add_to_word_list(node->id);
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+
+		/* check if p is a word in the dictionary */
+		get_all_permutations(p+1, len - 1);
+
+		/*
+		 * Bring the next letter to position 0. get_all_permutations()
+		 * starting with that letter.
+		 */
+		if (i < len - 1) {
+			swap(&p[0], &p[i+1]);
+		} else {
+			/*
+			 * Indicates completion of all permutations. Time to
+			 * restore the string to its initial state. If the
+			 * initial string was "abcde", at this point, due to 4
+			 * swaps, (not 5, since we are in the fifth iteration)
+			 * the string would be - "eabcd". We restore initial
+			 * condition by doing a rotate_left_once.
+			 */
+			for (i = 0; i < len - 1; i++) {
+				swap(&p[i], &p[i+1]);
+			}
+		}
+	}
+}
+
+/* Put the signature (sorted letter codes) of word into sig */
+void
+get_signature(char *word, char *sig)
+{
+	int i, j, len = strlen(word);
+	char t;
+
+	strcpy(sig, word);
+	for (i = 1; i < len; i++) {
+		t = sig[i];
+		for (j = i; j > 0 && (uint8_t)sig[j - 1] > (uint8_t)t; j--) {
+			sig[j] = sig[j - 1];
+		}
+		sig[j] = t;
+	}
+}
+
+struct sig_entry *
+find_signature(sig_index_t *index, char *sig)
+{
+	struct sig_entry *se;
+
+	index->si_probes++;
+	se = index->si_buckets[hash_word(sig) & (index->si_nbuckets - 1)];
+	for (; se; se = se->se_next) {
+		if (strcmp(se->se_sig, sig) == 0) {
+			index->si_hits++;
+			return (se);
+		}
+	}
+	return (NULL);
+}
+
+void
+build_sig_index(tree_handle_t *handle, sig_index_t *index)
+{
+	struct sig_entry *se, **bucket;
+	wnode_t *node;
+	char *sig;
+
+	memset(index, 0, sizeof(sig_index_t));
+	for (index->si_nbuckets = 1;
+	    index->si_nbuckets < handle->th_nwords;
+	    index->si_nbuckets <<= 1)
+		;
+	index->si_buckets = calloc(index->si_nbuckets,
+	    sizeof(struct sig_entry *));
+	/* There are never more signatures than words */
+	index->si_entries = malloc((handle->th_nwords + 1) *
+	    sizeof(struct sig_entry));
+	if (index->si_buckets == NULL || index->si_entries == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	RB_FOREACH(node, word_tree, &handle->th_tree) {
+		/* The signature and its hash were worked out while loading */
+		sig = SIG_OF(node->id);
+		bucket = &index->si_buckets[node->sig_hash &
+		    (index->si_nbuckets - 1)];
+		for (se = *bucket; se; se = se->se_next) {
+			if (strcmp(se->se_sig, sig) == 0) {
+				break;
+			}
+		}
+		if (se == NULL) {
+			se = &index->si_entries[index->si_nsigs];
+			se->se_sig = sig;
+			se->se_words = NULL;
+			se->se_next = *bucket;
+			*bucket = se;
+			index->si_nsigs++;
+		}
+		node->sig_next = se->se_words;
+		se->se_words = node;
+	}
+	/* Probes made while building are not interesting */
+	index->si_probes = index->si_hits = 0;
+}
+
+/*
+ * Find or add the child with the given code under parent, keeping the
+ * children in code order. The root, node 0, is never a child, so 0 can
+ * stand for "none".
+ */
+uint32_t
+sig_trie_child(sig_trie_t *trie, uint32_t parent, uint8_t code)
+{
+	struct sig_trie_node *n;
+	uint32_t prev = 0, k;
+
+	for (k = trie->st_nodes[parent].tn_child;
+	    k && trie->st_nodes[k].tn_code < code;
+	    prev = k, k = trie->st_nodes[k].tn_sibling)
+		;
+	if (k && trie->st_nodes[k].tn_code == code) {
+		return (k);
+	}
+
+	grow_array((void **)&trie->st_nodes, &trie->st_size, trie->st_nnodes,
+	    1, sizeof(struct sig_trie_node));
+	n = &trie->st_nodes[trie->st_nnodes];
+	n->tn_code = code;
+	n->tn_child = 0;
+	n->tn_sibling = k;
+	n->tn_entry = NULL;
+	if (prev) {
+		trie->st_nodes[prev].tn_sibling = trie->st_nnodes;
+	} else {
+		trie->st_nodes[parent].tn_child = trie->st_nnodes;
+	}
+	return (trie->st_nnodes++);
+}
+
+void
+build_sig_trie(sig_index_t *index, sig_trie_t *trie)
+{
+	struct sig_entry *se;
+	uint32_t b, node;
+	char *p;
+
+	memset(trie, 0, sizeof(sig_trie_t));
+	grow_array((void **)&trie->st_nodes, &trie->st_size, 0, 1,
+	    sizeof(struct sig_trie_node));
+	memset(&trie->st_nodes[0], 0, sizeof(struct sig_trie_node));
+	trie->st_nnodes = 1;
+
+	for (b = 0; b < index->si_nbuckets; b++) {
+		for (se = index->si_buckets[b]; se; se = se->se_next) {
+			node = 0;
+			for (p = se->se_sig; *p != '\0'; p++) {
+				node = sig_trie_child(trie, node, (uint8_t)*p);
+			}
+			trie->st_nodes[node].tn_entry = se;
+		}
+	}
+}
+
+/*
+ * Sub-word mode (-s). Rather than visiting every permutation of the input
+ * and probing each of its suffixes, enumerate the distinct sub-multisets
+ * of the input letters directly and probe the signature index once for
+ * each. letters[] holds the distinct letter codes of the input in
+ * ascending order and counts[] how often each occurs; the sub-multiset
+ * being built is kept in sig, already in signature order. With n letters
+ * that is at most 2^n - 1 probes, and far fewer when letters repeat.
+ */
+void
+get_sub_words(uint8_t *letters, uint8_t *counts, int nletters, char *sig,
+    int len)
+{
+	struct sig_entry *se;
+	wnode_t *node;
+	int i;
+
+	if (query_stopped()) {
+		return;
+	}
+	if (nletters == 0) {
+		if (len == 0) {
+			return;
+		}
+		sig[len] = '\0';
+		if ((se = find_signature(&si, sig)) != NULL) {
+			for (node = se->se_words; node; node = node->sig_next) {
+				add_to_word_list(node->id);
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i <= counts[0]; i++) {
+		get_sub_words(letters + 1, counts + 1, nletters - 1, sig,
+		    len + i);
+		sig[len + i] = letters[0];
+	}
+}
+
+void
+get_all_sub_words(char *str)
+{
+	uint8_t letters[MAX_WORD_SIZE], counts[MAX_WORD_SIZE];
+	char sig[MAX_WORD_SIZE];
+	int i, n = 0;
+
+	get_signature(str, sig);
+	for (i = 0; sig[i] != '\0'; i++) {
+		if (n > 0 && letters[n - 1] == (uint8_t)sig[i]) {
+			counts[n - 1]++;
+		} else {
+			letters[n] = sig[i];
+			counts[n++] = 1;
+		}
+	}
+	get_sub_words(letters, counts, n, sig, 0);
+}
+
+/*
+ * The letters still available are kept as a count per letter code, sized
+ * to the dictionary's alphabet.
+ */
+uint8_t *
+get_letter_counts(char *str)
+{
+	uint8_t *counts = calloc(alpha.al_nletters + 1, sizeof(uint8_t));
+
+	if (counts == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (; *str != '\0'; str++) {
+		counts[(uint8_t)*str]++;
+	}
+	return (counts);
+}
+
+void
+put_back_letters(uint8_t *counts, char *str)
+{
+	for (; *str != '\0'; str++) {
+		counts[(uint8_t)*str]++;
+	}
+}
+
+/*
+ * Check if string "str" can be made from the available letters. If so,
+ * take its letters out of "counts".
+ */
+int
+take_letters(uint8_t *counts, char *str)
+{
+	char *p;
+
+	for (p = str; *p != '\0'; p++) {
+		if (counts[(uint8_t)*p] == 0) {
+			/* Undo what we took so far */
+			for (p--; p >= str; p--) {
+				counts[(uint8_t)*p]++;
+			}
+			return (0);
+		}
+		counts[(uint8_t)*p]--;
+	}
+	return (1);
+}
+
+/*
+ * Sub-words by a walk of the tree (-t), skipping every subtree that
+ * word_node_augment() shows cannot hold a word made of the input
+ * letters. The walk is in order, so the word list comes out sorted.
+ */
+void
+get_tree_sub_words(wnode_t *node, uint32_t mask, int len, uint8_t *counts)
+{
+	if (node == NULL || (node->sub_need & ~mask) ||
+	    node->sub_min_len > len || query_stopped()) {
+		return;
+	}
+	tree_visits++;
+	get_tree_sub_words(RB_LEFT(node, rb_node), mask, len, counts);
+	if (!(node->mask & ~mask) && node->len <= len &&
+	    take_letters(counts, node->word)) {
+		put_back_letters(counts, node->word);
+		add_to_word_list(node->id);
+	}
+	get_tree_sub_words(RB_RIGHT(node, rb_node), mask, len, counts);
+}
+
+void
+get_all_tree_sub_words(char *str)
+{
+	uint8_t *counts = get_letter_counts(str);
+	uint32_t mask = 0;
+	char *p;
+
+	for (p = str; *p != '\0'; p++) {
+		mask |= LETTER_BIT((uint8_t)*p);
+	}
+	get_tree_sub_words(RB_ROOT(&th.th_tree), mask, p - str, counts);
+	free(counts);
+}
+
+/* Sub-words from the signature trie (-a); see struct sig_trie_node */
+void
+get_trie_sub_words(uint32_t node, uint8_t *counts)
+{
+	struct sig_trie_node *n = &trie.st_nodes[node];
+	wnode_t *w;
+	uint32_t k;
+
+	if (query_stopped()) {
+		return;
+	}
+	trie.st_visits++;
+	if (n->tn_entry) {
+		for (w = n->tn_entry->se_words; w; w = w->sig_next) {
+			add_to_word_list(w->id);
+		}
+	}
+	for (k = n->tn_child; k; k = trie.st_nodes[k].tn_sibling) {
+		if (counts[trie.st_nodes[k].tn_code]) {
+			counts[trie.st_nodes[k].tn_code]--;
+			get_trie_sub_words(k, counts);
+			counts[trie.st_nodes[k].tn_code]++;
+		}
+	}
+}
+
+void
+get_all_trie_sub_words(char *str)
+{
+	uint8_t *counts = get_letter_counts(str);
+
+	get_trie_sub_words(0, counts);
+	free(counts);
+}
+
+void
+init_stack()
+{
+	stack_top = -1;
+}
+
+void
+push(word_id_t id)
+{
+	stack[++stack_top] = id;
+}
+
+void
+pop()
+{
+	stack_top--;
+}
+
+/*
+ * Print the dictionary spellings of a word, separated by '/' when several
+ * spellings share its key ("Polish/polish").
+ */
+void
+print_surface_forms(word_id_t id)
+{
+	struct list *f;
+
+	for (f = word_nodes[id]->forms; f; f = f->next) {
+		printf("%s%s", f->word, (f->next ? "/" : ""));
+	}
+}
+
+/*
+ * Print a solution made of words plus the required words, in word list
+ * order (the list is sorted, so that is the order of the IDs).
+ */
+void
+print_word_set(word_id_t *words, int n)
+{
+	word_id_t sorted[MAX_WORD_SIZE + MAX_LISTED_WORDS], t;
+	int i, j;
+
+	memcpy(sorted, words, n * sizeof(word_id_t));
+	memcpy(sorted + n, limits.sl_required,
+	    limits.sl_nrequired * sizeof(word_id_t));
+	n += limits.sl_nrequired;
+	for (i = 1; i < n; i++) {
+		t = sorted[i];
+		for (j = i; j > 0 && sorted[j - 1] > t; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = t;
+	}
+	for (i = 0; i < n; i++) {
+		print_surface_forms(sorted[i]);
+		printf("%s", (i == n - 1 ? "" : " "));
+	}
+	printf("\n");
+}
+
+/* Print a solution found by a search, counting it against the budgets */
+void
+print_solution(word_id_t *words, int n)
+{
+	if (budget.qb_stop != STOP_NONE) {
+		return;
+	}
+	print_word_set(words, n);
+	count_result();
+}
+
+void
+print_stack()
+{
+	print_solution(stack, stack_top + 1);
+}
+
+/*
+ * Can a partial solution of nwords words (required ones included) with
+ * len letters left still grow into one that meets the limits?
+ */
+int
+can_extend(int nwords, int len)
+{
+	if (limits.sl_max_words) {
+		if (nwords >= limits.sl_max_words ||
+		    len > (limits.sl_max_words - nwords) * limits.sl_longest) {
+			return (0);
+		}
+	}
+	if (len < limits.sl_shortest) {
+		return (0);
+	}
+	return (1);
+}
+
+/* Is a complete solution of nwords words big enough to print? */
+int
+enough_words(int nwords)
+{
+	return (nwords >= limits.sl_min_words);
+}
+
+void
+get_anagrams(word_id_t *ids, int n, int len, uint8_t *counts)
+{
+	char *word;
+	int i, wlen, nwords;
+
+	for (i = 0; len && i < n && !query_stopped(); i++) {
+		wlen = word_lens[ids[i]];
+		word = WORD_OF(ids[i]);
+		if (wlen <= len && take_letters(counts, word)) {
+			search_nodes++;
+			push(ids[i]);
+			len -= wlen;
+			nwords = stack_top + 1 + limits.sl_nrequired;
+			if (len && can_extend(nwords, len)) {
+				get_anagrams(ids + i + 1, n - i - 1, len,
+				    counts);
+			}
+			if (len == 0 && enough_words(nwords))
+				print_stack();
+			pop();
+			put_back_letters(counts, word);
+			len += wlen;
+		}
+	}
+}
+
+void
+init_cand_set(cand_set_t *cs, word_list_t *wl)
+{
+	struct cand *c;
+	char *p;
+	int i, n = wl->wl_n;
+	uint8_t code;
+
+	cs->cs_ncands = n;
+	cs->cs_cands = calloc(n ? n : 1, sizeof(struct cand));
+	cs->cs_by_letter = calloc(alpha.al_nletters + 1, sizeof(int *));
+	cs->cs_nby_letter = calloc(alpha.al_nletters + 1, sizeof(int));
+	if (!cs->cs_cands || !cs->cs_by_letter || !cs->cs_nby_letter) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		c = &cs->cs_cands[i];
+		c->c_id = wl->wl_ids[i];
+		c->c_word = WORD_OF(c->c_id);
+		c->c_len = word_lens[c->c_id];
+		for (p = c->c_word; *p != '\0'; p++) {
+			c->c_mask |= LETTER_BIT((uint8_t)*p);
+		}
+	}
+
+	/*
+	 * Two passes over the candidates: size each letter's list, then fill
+	 * it. A word is listed once per distinct letter it uses.
+	 */
+	for (i = 0; i < n; i++) {
+		for (p = cs->cs_cands[i].c_word; *p != '\0'; p++) {
+			code = *p;
+			if (strchr(cs->cs_cands[i].c_word, code) == p) {
+				cs->cs_nby_letter[code]++;
+			}
+		}
+	}
+	for (code = 1; code <= alpha.al_nletters; code++) {
+		cs->cs_by_letter[code] = malloc((cs->cs_nby_letter[code] + 1) *
+		    sizeof(int));
+		if (cs->cs_by_letter[code] == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		cs->cs_nby_letter[code] = 0;
+		if (code == MAX_LETTERS) {
+			break;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		for (p = cs->cs_cands[i].c_word; *p != '\0'; p++) {
+			code = *p;
+			if (strchr(cs->cs_cands[i].c_word, code) == p) {
+				cs->cs_by_letter[code][cs->cs_nby_letter[code]++] = i;
+			}
+		}
+	}
+}
+
+void
+cleanup_cand_set(cand_set_t *cs)
+{
+	int code;
+
+	for (code = 1; code <= alpha.al_nletters; code++) {
+		free(cs->cs_by_letter[code]);
+	}
+	free(cs->cs_by_letter);
+	free(cs->cs_nby_letter);
+	free(cs->cs_cands);
+}
+
+/* Print the chosen candidates in word list order, like print_stack() */
+void
+print_cand_solution(cand_set_t *cs, int *chosen, int nchosen)
+{
+	word_id_t words[MAX_WORD_SIZE];
+	int i;
+
+	for (i = 0; i < nchosen; i++) {
+		words[i] = cs->cs_cands[chosen[i]].c_id;
+	}
+	print_solution(words, nchosen);
+}
+
+/*
+ * Rarest-letter search (-r). Every solution must use the remaining letter
+ * that the fewest candidates contain, so each level only branches on the
+ * words containing that letter. Once a word's branch is done it is banned
+ * for the rest of the level, since every solution containing it has been
+ * found; this way each set of words is produced exactly once instead of
+ * once per ordering. Solutions are the same as get_anagrams(), printed
+ * with their words in the same order, though the lines come out in a
+ * different order.
+ */
+void
+get_anagrams_rarest(cand_set_t *cs, int len, uint8_t *counts, int *chosen,
+    int nchosen)
+{
+	struct cand *c;
+	uint32_t mask = 0;
+	int code, best = 0, i, k, nwords;
+
+	for (code = 1; code <= alpha.al_nletters; code++) {
+		if (counts[code] == 0) {
+			continue;
+		}
+		mask |= LETTER_BIT(code);
+		if (best == 0 ||
+		    cs->cs_nby_letter[code] < cs->cs_nby_letter[best]) {
+			best = code;
+		}
+	}
+
+	for (i = 0; i < cs->cs_nby_letter[best] && !query_stopped(); i++) {
+		k = cs->cs_by_letter[best][i];
+		c = &cs->cs_cands[k];
+		if (c->c_banned || c->c_len > len || (c->c_mask & ~mask) ||
+		    !take_letters(counts, c->c_word)) {
+			continue;
+		}
+		search_nodes++;
+		chosen[nchosen] = k;
+		c->c_banned = nchosen + 1;
+		nwords = nchosen + 1 + limits.sl_nrequired;
+		if (len == c->c_len) {
+			if (enough_words(nwords)) {
+				print_cand_solution(cs, chosen, nchosen + 1);
+			}
+		} else if (can_extend(nwords, len - c->c_len)) {
+			get_anagrams_rarest(cs, len - c->c_len, counts, chosen,
+			    nchosen + 1);
+		}
+		put_back_letters(counts, c->c_word);
+	}
+
+	/* Lift the bans placed at this level */
+	for (i = 0; i < cs->cs_nby_letter[best]; i++) {
+		c = &cs->cs_cands[cs->cs_by_letter[best][i]];
+		if (c->c_banned == nchosen + 1) {
+			c->c_banned = 0;
+		}
+	}
+}
+
+int
+word_listed(word_id_t *words, int n, word_id_t word)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (words[i] == word) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Copy of the word list holding only the words the search may choose
+ * from: long enough, not excluded and not one of the required words
+ * (those are placed up front). Sets *missing if a required word is not
+ * in the list, i.e. there can be no solution at all.
+ */
+void
+get_search_list(word_list_t *wl, word_list_t *out, int *missing)
+{
+	word_id_t id;
+	int i, len, found = 0;
+
+	memset(out, 0, sizeof(word_list_t));
+	limits.sl_shortest = MAX_WORD_SIZE;
+	limits.sl_longest = 0;
+	for (i = 0; i < wl->wl_n; i++) {
+		id = wl->wl_ids[i];
+		if (word_listed(limits.sl_required, limits.sl_nrequired, id)) {
+			found++;
+			continue;
+		}
+		len = word_lens[id];
+		if (len < limits.sl_min_len ||
+		    word_listed(limits.sl_excluded, limits.sl_nexcluded, id)) {
+			continue;
+		}
+		if (len < limits.sl_shortest) {
+			limits.sl_shortest = len;
+		}
+		if (len > limits.sl_longest) {
+			limits.sl_longest = len;
+		}
+		wl_add(out, id);
+	}
+
+	/* Required words must be distinct candidates themselves */
+	*missing = 0;
+	for (i = 0; i < limits.sl_nrequired; i++) {
+		if (limits.sl_required[i] == NO_WORD ||
+		    word_lens[limits.sl_required[i]] < limits.sl_min_len ||
+		    word_listed(limits.sl_excluded, limits.sl_nexcluded,
+		    limits.sl_required[i]) ||
+		    word_listed(limits.sl_required, i, limits.sl_required[i])) {
+			*missing = 1;
+		}
+	}
+	if (found < limits.sl_nrequired) {
+		*missing = 1;
+	}
+}
+
+/*
+ * k-word mode (-k). Only the first k - 1 words of a solution are chosen
+ * by backtracking. The letters left over must then make up the last word
+ * on their own, so it is found with one probe of the signature index
+ * instead of a scan of the candidates: two-word anagrams cost one probe
+ * per candidate. As in get_anagrams() the words of a solution are taken
+ * in word list order, so the last one must sort after the others.
+ */
+struct kword_search {
+	uint8_t ks_letters[MAX_WORD_SIZE];	/* distinct input letters */
+	int ks_nletters;
+	uint8_t *ks_counts;			/* letters still available */
+};
+
+/* Can word complete the solution on the stack? */
+int
+last_word_ok(word_id_t id)
+{
+	return (word_lens[id] >= limits.sl_min_len &&
+	    !word_listed(limits.sl_excluded, limits.sl_nexcluded, id) &&
+	    !word_listed(limits.sl_required, limits.sl_nrequired, id) &&
+	    (stack_top < 0 || id > stack[stack_top]));
+}
+
+/* Words with a signature are chained in reverse order; print in order */
+void
+print_last_words(wnode_t *node)
+{
+	if (node == NULL) {
+		return;
+	}
+	print_last_words(node->sig_next);
+	if (last_word_ok(node->id)) {
+		search_nodes++;
+		push(node->id);
+		if (enough_words(stack_top + 1 + limits.sl_nrequired)) {
+			print_stack();
+		}
+		pop();
+	}
+}
+
+void
+get_anagrams_k(word_id_t *ids, int nids, int len, struct kword_search *ks,
+    int left)
+{
+	struct sig_entry *se;
+	char sig[MAX_WORD_SIZE], *word;
+	int i, j, n, wlen;
+
+	if (left == 1) {
+		for (i = 0, n = 0; i < ks->ks_nletters; i++) {
+			for (j = 0; j < ks->ks_counts[ks->ks_letters[i]]; j++) {
+				sig[n++] = ks->ks_letters[i];
+			}
+		}
+		sig[n] = '\0';
+		if ((se = find_signature(&si, sig)) != NULL) {
+			print_last_words(se->se_words);
+		}
+		return;
+	}
+
+	for (i = 0; i < nids && !query_stopped(); i++) {
+		wlen = word_lens[ids[i]];
+		word = WORD_OF(ids[i]);
+		/* Some letters have to be left for the words after this one */
+		if (wlen < len && take_letters(ks->ks_counts, word)) {
+			search_nodes++;
+			push(ids[i]);
+			len -= wlen;
+			if (can_extend(stack_top + 1 + limits.sl_nrequired,
+			    len)) {
+				get_anagrams_k(ids + i + 1, nids - i - 1, len,
+				    ks, left - 1);
+			}
+			pop();
+			put_back_letters(ks->ks_counts, word);
+			len += wlen;
+		}
+	}
+}
+
+struct class_member {
+	char cm_sig[MAX_WORD_SIZE];
+	word_id_t cm_id;
+};
+
+int
+class_member_compare(const void *a, const void *b)
+{
+	const struct class_member *x = a, *y = b;
+	int ret;
+
+	if ((ret = strcmp(x->cm_sig, y->cm_sig)) != 0) {
+		return (ret);
+	}
+	return (x->cm_id < y->cm_id ? -1 : x->cm_id > y->cm_id);
+}
+
+int
+word_class_compare(const void *a, const void *b)
+{
+	word_id_t x = ((struct word_class *)a)->wc_ids[0];
+	word_id_t y = ((struct word_class *)b)->wc_ids[0];
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Group the words of wl by signature */
+void
+init_class_set(class_set_t *cl, word_list_t *wl)
+{
+	struct class_member *m;
+	struct word_class *wc;
+	int i, n = wl->wl_n;
+
+	m = malloc((n + 1) * sizeof(struct class_member));
+	cl->cl_ids = malloc((n + 1) * sizeof(word_id_t));
+	cl->cl_classes = malloc((n + 1) * sizeof(struct word_class));
+	if (m == NULL || cl->cl_ids == NULL || cl->cl_classes == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		m[i].cm_id = wl->wl_ids[i];
+		strcpy(m[i].cm_sig, SIG_OF(m[i].cm_id));
+	}
+	qsort(m, n, sizeof(struct class_member), class_member_compare);
+
+	cl->cl_nclasses = 0;
+	for (i = 0, wc = NULL; i < n; i++) {
+		cl->cl_ids[i] = m[i].cm_id;
+		if (i == 0 || strcmp(m[i - 1].cm_sig, m[i].cm_sig) != 0) {
+			wc = &cl->cl_classes[cl->cl_nclasses++];
+			wc->wc_ids = &cl->cl_ids[i];
+			wc->wc_n = 0;
+			wc->wc_len = word_lens[m[i].cm_id];
+			wc->wc_used = 0;
+		}
+		wc->wc_n++;
+	}
+	qsort(cl->cl_classes, cl->cl_nclasses, sizeof(struct word_class),
+	    word_class_compare);
+	free(m);
+}
+
+void
+cleanup_class_set(class_set_t *cl)
+{
+	free(cl->cl_classes);
+	free(cl->cl_ids);
+}
+
+/* Ways to pick k different words out of n */
+uint64_t
+choose(int n, int k)
+{
+	uint64_t r = 1;
+	int i;
+
+	for (i = 1; i <= k; i++) {
+		r = r * (n - k + i) / i;
+	}
+	return (r);
+}
+
+void
+print_class(struct word_class *wc)
+{
+	int i;
+
+	if (wc->wc_n == 1) {
+		print_surface_forms(wc->wc_ids[0]);
+		return;
+	}
+	printf("{");
+	for (i = 0; i < wc->wc_n; i++) {
+		printf("%s", i ? "," : "");
+		print_surface_forms(wc->wc_ids[i]);
+	}
+	printf("}");
+}
+
+/*
+ * Print a solution of classes in its compact form, "{art,rat,tar} {sing}",
+ * with the required words merged in by word list order. A class chosen
+ * twice stands for two different words of it.
+ */
+void
+print_class_solution(class_set_t *cl, int *chosen, int nchosen)
+{
+	int order[MAX_WORD_SIZE + MAX_LISTED_WORDS];
+	word_id_t first[MAX_WORD_SIZE + MAX_LISTED_WORDS], tf;
+	uint64_t n = 1;
+	int i, j, k, to;
+
+	if (budget.qb_stop != STOP_NONE) {
+		return;
+	}
+	for (i = 0; i < nchosen; i++) {
+		order[i] = chosen[i];
+		first[i] = cl->cl_classes[chosen[i]].wc_ids[0];
+	}
+	/* Required words are marked by negative order entries */
+	for (k = 0; k < limits.sl_nrequired; k++, i++) {
+		order[i] = -1 - k;
+		first[i] = limits.sl_required[k];
+	}
+	for (i = 1; i < nchosen + limits.sl_nrequired; i++) {
+		tf = first[i];
+		to = order[i];
+		for (j = i; j > 0 && first[j - 1] > tf; j--) {
+			first[j] = first[j - 1];
+			order[j] = order[j - 1];
+		}
+		first[j] = tf;
+		order[j] = to;
+	}
+
+	for (i = 0; i < nchosen + limits.sl_nrequired; i++) {
+		printf("%s", i ? " " : "");
+		if (order[i] < 0) {
+			print_surface_forms(limits.sl_required[-1 - order[i]]);
+		} else {
+			print_class(&cl->cl_classes[order[i]]);
+		}
+	}
+	printf("\n");
+
+	for (i = 0; i < nchosen; i = j) {
+		for (j = i; j < nchosen && chosen[j] == chosen[i]; j++)
+			;
+		n *= choose(cl->cl_classes[chosen[i]].wc_n, j - i);
+	}
+	class_solutions++;
+	class_anagrams += n;
+	count_result();
+}
+
+/*
+ * The search of get_anagrams() over classes. Classes are taken in order,
+ * and one that still has unused words may be taken again, so every
+ * multiset of classes is tried once. The letters of a class are those of
+ * its first word.
+ */
+void
+get_anagram_classes(class_set_t *cl, int first, int len, uint8_t *counts,
+    int *chosen, int nchosen)
+{
+	struct word_class *wc;
+	char *word;
+	int i, nwords;
+
+	for (i = first; len && i < cl->cl_nclasses && !query_stopped(); i++) {
+		wc = &cl->cl_classes[i];
+		word = WORD_OF(wc->wc_ids[0]);
+		if (wc->wc_len <= len && take_letters(counts, word)) {
+			search_nodes++;
+			chosen[nchosen] = i;
+			wc->wc_used++;
+			len -= wc->wc_len;
+			nwords = nchosen + 1 + limits.sl_nrequired;
+			if (len && can_extend(nwords, len)) {
+				get_anagram_classes(cl,
+				    wc->wc_used < wc->wc_n ? i : i + 1, len,
+				    counts, chosen, nchosen + 1);
+			}
+			if (len == 0 && enough_words(nwords)) {
+				print_class_solution(cl, chosen, nchosen + 1);
+			}
+			wc->wc_used--;
+			put_back_letters(counts, word);
+			len += wc->wc_len;
+		}
+	}
+}
+
+/* Letter values of the built-in tables, 'a' to 'z' */
+static const struct score_table {
+	const char *st_name;
+	int st_values[26];
+} score_tables[] = {
+	{ "scrabble", { 1, 3, 3, 2, 1, 4, 2, 4, 1, 8, 5, 1, 3, 1, 1, 3, 10,
+	    1, 1, 1, 1, 4, 4, 8, 4, 10 } },
+	{ "wwf", { 1, 4, 4, 2, 1, 4, 3, 3, 1, 10, 5, 2, 4, 2, 1, 4, 10, 1,
+	    1, 1, 2, 5, 4, 8, 3, 10 } },
+};
+
+/*
+ * Set letter_value[] from a built-in table, by the unaccented lower case
+ * form of each letter, or from a file of "<letter> <value>" lines. A
+ * letter without a value scores 0.
+ */
+void
+load_letter_values(char *table)
+{
+	char line[256], letter[64], enc[MAX_WORD_SIZE];
+	const struct score_table *st = NULL;
+	uint32_t cp;
+	size_t i;
+	FILE *fp;
+	int code, value;
+
+	memset(letter_value, 0, sizeof(letter_value));
+	for (i = 0; i < sizeof(score_tables) / sizeof(score_tables[0]); i++) {
+		if (strcmp(table, score_tables[i].st_name) == 0) {
+			st = &score_tables[i];
+		}
+	}
+	if (st) {
+		for (code = 1; code <= alpha.al_nletters; code++) {
+			cp = alpha.al_cp[code];
+			if (cp >= 0xc0 && cp < 0x100 &&
+			    latin1_base[cp - 0xc0] != '-') {
+				cp = latin1_base[cp - 0xc0];
+			} else if (cp >= 0x100 && cp < 0x180 &&
+			    latin_ext_a_base[cp - 0x100] != '-') {
+				cp = latin_ext_a_base[cp - 0x100];
+			}
+			if (cp < 0x80 && isalpha(cp)) {
+				letter_value[code] =
+				    st->st_values[tolower(cp) - 'a'];
+			}
+		}
+		return;
+	}
+
+	if ((fp = fopen(table, "r")) == NULL) {
+		perror(table);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %d", letter, &value) != 2) {
+			continue;
+		}
+		if (encode_word(&alpha, letter, enc) == 1) {
+			letter_value[(uint8_t)enc[0]] = value;
+		}
+	}
+	fclose(fp);
+}
+
+int
+word_score(char *word)
+{
+	int score = 0;
+
+	for (; *word != '\0'; word++) {
+		score += letter_value[(uint8_t)*word];
+	}
+	return (score);
+}
+
+void
+init_word_scores(void)
+{
+	word_id_t id;
+
+	if ((word_scores = malloc((th.th_nwords + 1) * sizeof(int))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (id = 0; id < th.th_nwords; id++) {
+		word_scores[id] = word_score(WORD_OF(id));
+	}
+}
+
+void
+init_best_k(best_k_t *bk, int k)
+{
+	bk->bk_k = k;
+	bk->bk_n = 0;
+	if ((bk->bk_heap = malloc(k * sizeof(struct best_entry))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+/* Score a solution has to beat to be kept, -1 while there is room */
+int
+best_k_bar(best_k_t *bk)
+{
+	return (bk->bk_n < bk->bk_k ? -1 : bk->bk_heap[0].be_score);
+}
+
+/* Offer the solution on the stack, worth score, to the K best */
+void
+best_k_offer(best_k_t *bk, int score)
+{
+	struct best_entry *h = bk->bk_heap, t;
+	int i, c;
+
+	if (bk->bk_n < bk->bk_k) {
+		/* Sift the new entry up */
+		for (i = bk->bk_n++; i > 0 && h[(i - 1) / 2].be_score > score;
+		    i = (i - 1) / 2) {
+			h[i] = h[(i - 1) / 2];
+		}
+	} else if (score > h[0].be_score) {
+		/* Replace the worst and sift it down */
+		for (i = 0; (c = 2 * i + 1) < bk->bk_n; i = c) {
+			if (c + 1 < bk->bk_n &&
+			    h[c + 1].be_score < h[c].be_score) {
+				c++;
+			}
+			if (h[c].be_score >= score) {
+				break;
+			}
+			h[i] = h[c];
+		}
+	} else {
+		return;
+	}
+	t.be_score = score;
+	t.be_nwords = stack_top + 1;
+	memcpy(t.be_words, stack, t.be_nwords * sizeof(word_id_t));
+	h[i] = t;
+}
+
+/* Best first, ties in word list order */
+int
+best_entry_compare(const void *a, const void *b)
+{
+	const struct best_entry *x = a, *y = b;
+	int i;
+
+	if (x->be_score != y->be_score) {
+		return (y->be_score - x->be_score);
+	}
+	for (i = 0; i < x->be_nwords && i < y->be_nwords; i++) {
+		if (x->be_words[i] != y->be_words[i]) {
+			return (x->be_words[i] < y->be_words[i] ? -1 : 1);
+		}
+	}
+	return (x->be_nwords - y->be_nwords);
+}
+
+void
+print_best_k(best_k_t *bk)
+{
+	int i;
+
+	qsort(bk->bk_heap, bk->bk_n, sizeof(struct best_entry),
+	    best_entry_compare);
+	for (i = 0; i < bk->bk_n; i++) {
+		printf("%d : ", bk->bk_heap[i].be_score);
+		print_word_set(bk->bk_heap[i].be_words,
+		    bk->bk_heap[i].be_nwords);
+	}
+}
+
+void
+cleanup_best_k(best_k_t *bk)
+{
+	free(bk->bk_heap);
 }
 
-void __attribute__((always_inline))
-swap(char *a, char *b)
+/* Best first, ties in word list order */
+int
+scored_word_compare(const void *a, const void *b)
 {
-	int t;
+	const struct scored_word *x = a, *y = b;
 
-	t = *a;
-	*a = *b;
-	*b = t;
+	if (x->sw_score != y->sw_score) {
+		return (y->sw_score - x->sw_score);
+	}
+	return (x->sw_id < y->sw_id ? -1 : x->sw_id > y->sw_id);
 }
 
-struct list *
-get_wlist_node(char *str)
+/* Reorder the word list by decreasing score */
+void
+sort_by_score(word_list_t *wl)
 {
-	struct list *temp = malloc(sizeof(struct list));
-	if (temp) {
-		temp->word = malloc(strlen(str));
-		if (temp->word) {
-			strcpy(temp->word, str);
-			temp->next = NULL;
-		} else {
-			perror("malloc");
-			exit(1);
-		}
-	} else {
+	struct scored_word *sw;
+	int i;
+
+	if ((sw = malloc((wl->wl_n + 1) * sizeof(struct scored_word))) ==
+	    NULL) {
 		perror("malloc");
 		exit(1);
 	}
+	for (i = 0; i < wl->wl_n; i++) {
+		sw[i].sw_score = word_scores[wl->wl_ids[i]];
+		sw[i].sw_id = wl->wl_ids[i];
+	}
+	qsort(sw, wl->wl_n, sizeof(struct scored_word), scored_word_compare);
+	for (i = 0; i < wl->wl_n; i++) {
+		wl->wl_ids[i] = sw[i].sw_id;
+	}
+	free(sw);
 }
 
-int
-add_to_word_list(char *str)
+/*
+ * Branch and bound over the candidates ids, in decreasing score order.
+ * score is that of the words chosen so far and left the value of the
+ * letters still in counts. Every solution further down this level gains
+ * at most left, and under -M at most a word per remaining slot, none
+ * worth more than ids[i]; once that cannot beat the K-th best, neither
+ * can anything after ids[i].
+ */
+void
+get_best_anagrams(best_k_t *bk, word_id_t *ids, int n, int len,
+    uint8_t *counts, int score, int left)
 {
-	struct list *prev, *temp;
-
-	if (word_list_head == NULL) {
-		word_list_head = get_wlist_node(str);
-		return (0);
-	}
-
-	for (prev = temp = word_list_head; temp;
-	    prev = temp, temp = temp->next) {
-		if (strcmp(temp->word, str) == 0) {
-			/* Found */
-			return EEXIST;
+	char *word;
+	int i, ws, wlen, gain, nwords;
+
+	nwords = stack_top + 1 + limits.sl_nrequired;
+	for (i = 0; i < n && !query_stopped(); i++) {
+		ws = word_scores[ids[i]];
+		gain = left;
+		if (limits.sl_max_words &&
+		    (limits.sl_max_words - nwords) * ws < gain) {
+			gain = (limits.sl_max_words - nwords) * ws;
+		}
+		if (score + gain <= best_k_bar(bk)) {
+			break;
+		}
+		wlen = word_lens[ids[i]];
+		word = WORD_OF(ids[i]);
+		if (wlen > len || !take_letters(counts, word)) {
+			continue;
+		}
+		search_nodes++;
+		push(ids[i]);
+		if (enough_words(nwords + 1)) {
+			best_k_offer(bk, score + ws);
 		}
+		if (len - wlen >= limits.sl_shortest &&
+		    (!limits.sl_max_words ||
+		    nwords + 1 < limits.sl_max_words)) {
+			get_best_anagrams(bk, ids + i + 1, n - i - 1,
+			    len - wlen, counts, score + ws, left - ws);
+		}
+		pop();
+		put_back_letters(counts, word);
 	}
-
-	/* New word. Add to list */
-	temp = get_wlist_node(str);
-	prev->next = temp;
-	return (0);
 }
 
 /*
- * The recursive algorithm below does the following:
- * Lets take the letter combination - abc
- *
- * It starts off by producing all possible permutations starting with 'a'.
- * This is done by keeping 'a' unchanged and calling get_all_permutations
- * (recursively) with an advanced pointer (p+1). Note that the changes are being
- * done in-place and hence the input string is getting modified with each swap.
- * So, at the end of all iterations, get_all_permutations() makes sure that it
- * returns the input string to its initial state.
- *
- * In the above example, the following is the call stack():
- * We use the short form g_a_c() to represent get_all_permutations().
- * g_a_c(abc, 3)
- *   g_a_c(bc, 2)
- *     g_a_c(c, 1) -> Print 'abc'
- *   i is 0 here, which is less than (len - 1) => (2 - 1)
- *   swap elem0 with elem1 => b with c. String becomes cb
- *   g_a_c(cb, 2)
- *     g_a_c(b, 1) -> Print 'acb'
- *   i is 1 here which is NOT less than (2 - 1). Time to restore the string to
- *   its original position
- *   Rotate the current string to the left once to get back to the initial
- *   state.
- *   String no becomes 'bc'.
- *
- * After all the permutations starting with 'a', it brings the next letter in
- * the input string to the 0th place by swapping it with what was there
- * already. In this case, 'b' is swapped with 'a'. Now, the string becomes
- * 'bac'. It agains gets all permutations starting with 'b'. This way, it goes
- * all the way until all the for the last letter is obtained.
+ * Find the anagrams of the letters in str that use words from the word
+ * list wl, subject to the search limits. With kwords set, find those of
+ * exactly that many words through the signature index. With classes set,
+ * search over anagram classes and print solutions in compact form. With
+ * best set, print only the best that many word sets by score, which need
+ * not use every letter.
  */
-
 void
-get_all_permutations(char *p, int len)
+search_anagrams(word_list_t *wl, char *str, int rarest, int kwords,
+    int classes, int best)
 {
-	int i, t;
+	word_list_t search_list;
+	struct kword_search ks;
+	class_set_t cl;
+	cand_set_t cs;
+	best_k_t bk;
+	uint8_t *counts;
+	int chosen[MAX_WORD_SIZE];
+	int i, len, missing, score, left;
+
+	get_search_list(wl, &search_list, &missing);
+	counts = get_letter_counts(str);
+	len = strlen(str);
+
+	/* The required words take their letters first */
+	for (i = 0; !missing && i < limits.sl_nrequired; i++) {
+		if (!take_letters(counts, WORD_OF(limits.sl_required[i]))) {
+			missing = 1;
+		}
+		len -= word_lens[limits.sl_required[i]];
+	}
 
-	if (len == 1) {
-		char *q;
-		if (*p == 'a' || *p == 'i' || *p == 'A' || *p == 'I') {
-			/* The only two single letter words */
-			add_to_word_list(p);
+	if (missing) {
+		/* Nothing to do */
+	} else if (best) {
+		init_best_k(&bk, best);
+		for (i = 0, score = 0; i < limits.sl_nrequired; i++) {
+			score += word_scores[limits.sl_required[i]];
+		}
+		for (i = 1, left = 0; i <= alpha.al_nletters; i++) {
+			left += counts[i] * letter_value[i];
+		}
+		if (limits.sl_nrequired && enough_words(limits.sl_nrequired)) {
+			best_k_offer(&bk, score);
+		}
+		sort_by_score(&search_list);
+		get_best_anagrams(&bk, search_list.wl_ids, search_list.wl_n,
+		    len, counts, score, left);
+		print_best_k(&bk);
+		cleanup_best_k(&bk);
+	} else if (len == 0) {
+		if (limits.sl_nrequired && enough_words(limits.sl_nrequired)) {
+			print_solution(NULL, 0);
 		}
-		for (q = copy; strlen(q) >= 2 && *q != '\0'; q++) {
-			if (search_word_in_tree(&th, q) == 0) {
-				add_to_word_list(q);
+	} else if (!can_extend(limits.sl_nrequired, len)) {
+		/* Nothing to do */
+	} else if (kwords) {
+		ks.ks_counts = counts;
+		for (i = 1, ks.ks_nletters = 0; i <= alpha.al_nletters; i++) {
+			if (counts[i]) {
+				ks.ks_letters[ks.ks_nletters++] = i;
 			}
 		}
-		return;
+		get_anagrams_k(search_list.wl_ids, search_list.wl_n, len, &ks,
+		    kwords - limits.sl_nrequired);
+	} else if (classes) {
+		init_class_set(&cl, &search_list);
+		get_anagram_classes(&cl, 0, len, counts, chosen, 0);
+		cleanup_class_set(&cl);
+	} else if (rarest) {
+		init_cand_set(&cs, &search_list);
+		get_anagrams_rarest(&cs, len, counts, chosen, 0);
+		cleanup_cand_set(&cs);
+	} else {
+		get_anagrams(search_list.wl_ids, search_list.wl_n, len, counts);
 	}
 
-	for (i = 0; i < len; i++) {
-
-		/* check if p is a word in the dictionary */
-		get_all_permutations(p+1, len - 1);
+	free(counts);
+	wl_free(&search_list);
+}
 
-		/*
-		 * Bring the next letter to position 0. get_all_permutations()
-		 * starting with that letter.
-		 */
-		if (i < len - 1) {
-			swap(&p[0], &p[i+1]);
-		} else {
-			/*
-			 * Indicates completion of all permutations. Time to
-			 * restore the string to its initial state. If the
-			 * initial string was "abcde", at this point, due to 4
-			 * swaps, (not 5, since we are in the fifth iteration)
-			 * the string would be - "eabcd". We restore initial
-			 * condition by doing a rotate_left_once.
-			 */
-			for (i = 0; i < len - 1; i++) {
-				swap(&p[i], &p[i+1]);
-			}
-		}
-	}
+/* Empty the word list; bumping the stamp forgets which words it held */
+void cleanup_lists()
+{
+	word_list.wl_n = 0;
+	seen_stamp++;
 }
 
-/* Check if string "str" is a subset of "clist" */
 int
-word_in_charlist(char *clist, char *str)
+id_compare(const void *a, const void *b)
 {
-	char *p, *q;
-	char copy_clist[MAX_WORD_SIZE];
-	int found;
+	word_id_t x = *(word_id_t *)a, y = *(word_id_t *)b;
 
-	strcpy(copy_clist, clist);
+	return (x < y ? -1 : x > y);
+}
 
-	for (p = str; *p != '\0'; p++) {
-		found = 0;
-		for (q = &copy_clist[0]; *q != '\0'; q++) {
-			if (*p == *q) {
-				*q = PLACE_HOLDER_CHAR;
-				found = 1;
-				break;
-			}
-		}
-		if (!found) {
-			return (0);
-		}
-	}
-	strcpy(clist, copy_clist);
-	return (1);
+/* IDs are handed out in tree order, so this sorts by strcmp() */
+void
+sort_word_list(word_list_t *wl)
+{
+	qsort(wl->wl_ids, wl->wl_n, sizeof(word_id_t), id_compare);
 }
 
+
+	
 void
-add_to_charlist(char *clist, char *str)
+usage(int argc, char **argv)
 {
-	char *p, *q;
+	fprintf(stderr, "usage: %s [-c] [-d] "
+	    "[-r | -k <words> | -g | -K <best>] [-T <table>] [-s | -t | -a] "
+	    "[-j <threads>] [-m <min words>]\n\t[-M <max words>] [-l <min word length>] "
+	    "[-i <word>]... [-x <word>]... [-R <runs>]\n\t"
+	    "[-D <msec>] [-N <steps>] [-n <results>] "
+	    "<string> | -b <query file>\n"
+	    "\t-c : keep upper and lower case letters distinct\n"
+	    "\t-d : ignore diacritics (accents, cedillas, ...)\n"
+	    "\t-r : search anagrams by rarest remaining letter\n"
+	    "\t-k : only anagrams of exactly this many words (1-%d), the "
+	    "last word\n\t     looked up by signature (not with -r)\n"
+	    "\t-g : search over anagram classes and print each solution "
+	    "once,\n\t     as in \"{art,rat,tar} {sing}\"\n"
+	    "\t-s : find sub-words by letter combinations instead of "
+	    "permutations\n"
+	    "\t-t : find sub-words by a walk of the dictionary tree, "
+	    "skipping\n\t     subtrees whose words all need a missing "
+	    "letter\n"
+	    "\t-a : find sub-words through a trie of word signatures\n"
+	    "\t-K : print only the best this many word sets (1-%d) by "
+	    "score; they need\n\t     not use every letter\n"
+	    "\t-T : letter values for -K: scrabble (default), wwf or a "
+	    "file of\n\t     \"<letter> <value>\" lines\n"
+	    "\t-m, -M : only anagrams of at least/at most this many words\n"
+	    "\t-l : only use words of at least this many letters\n"
+	    "\t-i : only anagrams that include this word\n"
+	    "\t-x : never use this word\n"
+	    "\t-j : threads used to load the dictionary (default: one per "
+	    "CPU)\n"
+	    "\t-b : answer every query in the file (- for stdin), one per "
+	    "line,\n\t     building their word lists in one dictionary pass\n"
+	    "\t-R, --repeat : answer the query this many times on the loaded "
+	    "dictionary\n\t     and report min/median/max time per phase\n"
+	    "\t-D, --deadline : stop a query after this many milliseconds\n"
+	    "\t-N, --max-steps : stop a query after this many search steps\n"
+	    "\t-n, --max-results : stop a query after this many anagrams\n"
+	    "\t     A stopped query (or one interrupted with ^C) keeps "
+	    "what it found\n\t     and is flagged \"Search truncated\"\n",
+	    argv[0], MAX_KWORDS, MAX_BEST);
+	exit(1);
+}
 
-	q = str;
+uint64_t
+now_nsec(void)
+{
+	struct timespec ts;
 
-	for (p = clist; *p != '\0'; p++) {
-		if (*p == PLACE_HOLDER_CHAR) {
-			if (*q == '\0') {
-				/* We are done. Return. */
-				return;
-			} else {
-				*p = *q;
-				q++;
-			}
-		}
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
 }
 
-void
-init_stack()
+/* Charge the time since start to phase id; returns the time now */
+uint64_t
+end_phase(int id, uint64_t start)
 {
-	int i;
-	stack_top = -1;
-	for (i = 0; i < MAX_WORD_SIZE; i++) {
-		stack[i] = malloc(MAX_WORD_SIZE);
-		if (!stack[i]) {
-			perror("malloc");
+	uint64_t now = now_nsec();
+	struct phase *ph = &phases[id];
+
+	if (ph->ph_nsamples == ph->ph_size) {
+		ph->ph_size = ph->ph_size ? ph->ph_size * 2 : 16;
+		ph->ph_samples = realloc(ph->ph_samples,
+		    ph->ph_size * sizeof(uint64_t));
+		if (ph->ph_samples == NULL) {
+			perror("realloc");
 			exit(1);
 		}
 	}
+	ph->ph_samples[ph->ph_nsamples++] = now - start;
+	return (now);
 }
 
-void
-push(char *str)
+int
+sample_compare(const void *a, const void *b)
 {
-	strcpy(stack[++stack_top], str);
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+
+	return ((x > y) - (x < y));
 }
 
 void
-pop()
+print_phase_times(void)
 {
-	stack_top--;
+	struct phase *ph;
+	uint64_t *t;
+	int i, n;
+
+	for (i = 0; i < PHASE_COUNT; i++) {
+		ph = &phases[i];
+		if ((n = ph->ph_nsamples) == 0) {
+			continue;
+		}
+		t = ph->ph_samples;
+		fprintf(stderr, "time in microseconds for %s", ph->ph_name);
+		if (i == PHASE_LOAD) {
+			fprintf(stderr, " (%d threads)", load_threads);
+		}
+		if (n == 1) {
+			fprintf(stderr, " : %.3f\n", t[0] / 1e3);
+			continue;
+		}
+		qsort(t, n, sizeof(uint64_t), sample_compare);
+		fprintf(stderr, " : min %.3f, median %.3f, max %.3f (%d runs)\n",
+		    t[0] / 1e3, (n % 2 ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) /
+		    2) / 1e3, t[n - 1] / 1e3, n);
+	}
 }
 
 void
-print_stack()
+print_wordlist(word_list_t *wl)
 {
 	int i;
 
-	for (i = 0; i <= stack_top; i++) {
-		printf("%s%s", stack[i], (i == stack_top ? "" : " "));
+	for (i = 0; i < wl->wl_n; i++) {
+		print_surface_forms(wl->wl_ids[i]);
+		printf("\n");
 	}
-	printf("\n");
 }
 
-void
-get_anagrams(struct list *head, int len, char *charlist)
+/*
+ * Batch mode (-b). Instead of building each query's word list on its
+ * own, the dictionary is walked once for the whole batch. The letter
+ * counts of the queries are kept bit sliced: bs_at_least[code][k - 1]
+ * is the set of queries, one bit each, with at least k of that letter.
+ * A word fits the queries left in its running set after ANDing in, for
+ * the k-th occurrence of each of its letters, the set for k. That tests
+ * 64 queries per instruction, and the compiler can vectorize the loop
+ * over the set's words. The word is then appended to the word list of
+ * every query left in the set; as the words are walked in ID order, the
+ * word lists come out sorted.
+ */
+struct batch_query {
+	char *bq_input;
+	char bq_key[MAX_WORD_SIZE];	/* encoded input */
+	word_list_t bq_words;
+};
+
+typedef struct batch_scan {
+	int bs_nsets;			/* uint64_t words in a query set */
+	uint64_t *bs_all;		/* every query */
+	uint64_t **bs_at_least;		/* per letter code, see above */
+	uint8_t *bs_max;		/* most of a letter in any query */
+} batch_scan_t;
+
+/*
+ * Read the queries in path, one per line, keeping those that can be
+ * encoded. Returns how many were kept.
+ */
+int
+read_batch(char *path, struct batch_query **bqp)
 {
-	struct list *temp;
-	int wlen;
+	struct batch_query *bq = NULL;
+	char temp[MAX_WORD_SIZE];
+	int n = 0, size = 0;
+	FILE *fp;
 
-	if (head == NULL) {
-		return;
+	fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
 	}
-
-	for (temp = head; len && temp; temp = temp->next) {
-		wlen = strlen(temp->word);
-		if (wlen <= len && word_in_charlist(charlist, temp->word)) {
-			push(temp->word);
-			len -= wlen;
-			if (len) {
-				get_anagrams(temp->next, len, charlist);
+	while (fgets(temp, sizeof(temp), fp) != NULL) {
+		temp[strcspn(temp, "\r\n")] = '\0';
+		if (temp[0] == '\0') {
+			continue;
+		}
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			bq = realloc(bq, size * sizeof(struct batch_query));
+			if (bq == NULL) {
+				perror("realloc");
+				exit(1);
 			}
-			if (len == 0)
-				print_stack();
-			pop();
-			add_to_charlist(charlist, temp->word);
-			len += wlen;
 		}
+		if (validate_input(temp) != 0 ||
+		    encode_word(&alpha, temp, bq[n].bq_key) <= 0) {
+			fprintf(stderr, "Skipping query %s : not letters the "
+			    "dictionary uses\n", temp);
+			continue;
+		}
+		if ((bq[n].bq_input = strdup(temp)) == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+		memset(&bq[n].bq_words, 0, sizeof(word_list_t));
+		n++;
 	}
-}
-
-void cleanup_lists()
-{
-	struct list *cur, *next;
-
-	for (cur = next = word_list_head; cur; ) {
-		next = cur->next;
-		free(cur->word);
-		free(cur);
-		cur = next;
+	if (fp != stdin) {
+		fclose(fp);
 	}
-	word_list_head = NULL;
+	*bqp = bq;
+	return (n);
 }
 
-/* O(n^2) algorithm assuming that the wordlist is not too big */
 void
-sort_word_list(struct list *wlist)
+init_batch_scan(batch_scan_t *bs, struct batch_query *bq, int n)
 {
-	struct list *t1, *t2;
-	char *temp;
+	uint8_t *counts;
+	uint64_t *set;
+	int q, c, k;
+
+	bs->bs_nsets = (n + 63) / 64;
+	bs->bs_all = calloc(bs->bs_nsets, sizeof(uint64_t));
+	bs->bs_at_least = calloc(alpha.al_nletters + 1, sizeof(uint64_t *));
+	bs->bs_max = calloc(alpha.al_nletters + 1, sizeof(uint8_t));
+	if (!bs->bs_all || !bs->bs_at_least || !bs->bs_max) {
+		perror("calloc");
+		exit(1);
+	}
 
-	for (t1 = wlist; t1; t1 = t1->next) {
-		for (t2 = t1; t2; t2 = t2->next) {
-			if (strcmp(t1->word, t2->word) > 0) {
-				temp = t1->word;
-				t1->word = t2->word;
-				t2->word = temp;
+	for (q = 0; q < n; q++) {
+		bs->bs_all[q / 64] |= 1ULL << (q % 64);
+		counts = get_letter_counts(bq[q].bq_key);
+		for (c = 1; c <= alpha.al_nletters; c++) {
+			if (counts[c] > bs->bs_max[c]) {
+				bs->bs_max[c] = counts[c];
+			}
+		}
+		free(counts);
+	}
+	for (c = 1; c <= alpha.al_nletters; c++) {
+		bs->bs_at_least[c] = calloc(bs->bs_max[c] * bs->bs_nsets + 1,
+		    sizeof(uint64_t));
+		if (bs->bs_at_least[c] == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+	for (q = 0; q < n; q++) {
+		counts = get_letter_counts(bq[q].bq_key);
+		for (c = 1; c <= alpha.al_nletters; c++) {
+			for (k = 1; k <= counts[c]; k++) {
+				set = bs->bs_at_least[c] +
+				    (k - 1) * bs->bs_nsets;
+				set[q / 64] |= 1ULL << (q % 64);
 			}
 		}
+		free(counts);
 	}
 }
 
-
-	
 void
-usage(int argc, char **argv)
+cleanup_batch_scan(batch_scan_t *bs)
 {
-	fprintf(stderr, "usage: %s <string>\n", argv[0]);
-	exit(1);
+	int c;
+
+	for (c = 1; c <= alpha.al_nletters; c++) {
+		free(bs->bs_at_least[c]);
+	}
+	free(bs->bs_at_least);
+	free(bs->bs_max);
+	free(bs->bs_all);
 }
 
-uint64_t
-to_microsec(struct timeval *tv)
+/* One pass over the dictionary, filling the word list of every query */
+void
+batch_scan(batch_scan_t *bs, struct batch_query *bq)
 {
-	return (tv->tv_sec * 1000000L + tv->tv_usec);
+	uint8_t seen[MAX_LETTERS + 1];
+	uint64_t *fit, *set, any, bits;
+	word_id_t id;
+	uint8_t *p, *w;
+	int i, q;
+
+	if ((fit = malloc(bs->bs_nsets * sizeof(uint64_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(seen, 0, sizeof(seen));
+
+	for (id = 0; id < th.th_nwords; id++) {
+		w = (uint8_t *)WORD_OF(id);
+		memcpy(fit, bs->bs_all, bs->bs_nsets * sizeof(uint64_t));
+		for (p = w, any = 1; any && *p != '\0'; p++) {
+			if (++seen[*p] > bs->bs_max[*p]) {
+				any = 0;
+				break;
+			}
+			set = bs->bs_at_least[*p] +
+			    (seen[*p] - 1) * bs->bs_nsets;
+			for (i = 0, any = 0; i < bs->bs_nsets; i++) {
+				fit[i] &= set[i];
+				any |= fit[i];
+			}
+		}
+		for (p = w; *p != '\0'; p++) {
+			seen[*p] = 0;
+		}
+		if (!any) {
+			continue;
+		}
+
+		for (i = 0; i < bs->bs_nsets; i++) {
+			for (bits = fit[i]; bits; bits &= bits - 1) {
+				q = i * 64 + __builtin_ctzll(bits);
+				wl_add(&bq[q].bq_words, id);
+			}
+		}
+	}
+	free(fit);
 }
 
+/* Answer every query in the batch, sharing one pass over the dictionary */
 void
-print_wordlist(struct list *head)
+run_batch(struct batch_query *bq, int n, int rarest, int kwords,
+    int classes, int best)
 {
-	struct list *temp;
+	batch_scan_t bs;
+	uint64_t t;
+	int q;
+
+	t = now_nsec();
+	init_batch_scan(&bs, bq, n);
+	batch_scan(&bs, bq);
+	cleanup_batch_scan(&bs);
+	t = end_phase(PHASE_COMBINATIONS, t);
+
+	for (q = 0; q < n; q++) {
+		printf("\n\nQuery : %s\n", bq[q].bq_input);
+		/* The scan leaves the word list sorted */
+		wl_free(&word_list);
+		word_list = bq[q].bq_words;
+		memset(&bq[q].bq_words, 0, sizeof(word_list_t));
+
+		start_budget();
+		printf("\n\nPrinting sorted wordlist..\n");
+		print_wordlist(&word_list);
+		fflush(stdout);
+		t = end_phase(PHASE_WORD_LIST, t);
+
+		printf("\n\nGenerating anagrams..\n");
+		search_anagrams(&word_list, bq[q].bq_key, rarest, kwords,
+		    classes, best);
+		end_budget();
+		fflush(stdout);
+		t = end_phase(PHASE_ANAGRAMS, t);
 
-	for (temp = head; temp; temp = temp->next) {
-		printf("%s\n", temp->word);
+		cleanup_lists();
 	}
 }
 
-int
-validate_input(char *str)
+/*
+ * Look up a word given with -i or -x. A word that cannot be encoded or
+ * is not in the dictionary can never be in the word list; NO_WORD stands
+ * in for it.
+ */
+word_id_t
+encode_listed_word(char *word)
 {
-	char *p;
+	char enc[MAX_WORD_SIZE];
+	wnode_t temp, *node;
 
-	for (p = str; *p != '\0'; p++) {
-		if (!isalpha(*p)) {
-			return (1);
-		}
+	if (encode_word(&alpha, word, enc) < 0) {
+		return (NO_WORD);
 	}
-	return (0);
+	temp.word = enc;
+	if ((node = RB_FIND(word_tree, &th.th_tree, &temp)) == NULL) {
+		return (NO_WORD);
+	}
+	return (node->id);
 }
 
 int
 main(int argc, char **argv)
 {
-	int ret;
+	int ret, opt;
+	int sub_word_mode = 0, rarest_mode = 0, kwords = 0, class_mode = 0;
+	int tree_mode = 0, trie_mode = 0, best_k = 0;
+	char *score_table = "scrabble";
+	char *input, *batch_file = NULL;
+	struct batch_query *bq;
+	int nbq = 0;
+	char *required[MAX_LISTED_WORDS], *excluded[MAX_LISTED_WORDS];
+	int i, run, runs = 1;
 	char temp[MAX_WORD_SIZE];
-	struct timeval c_start, c_end;
-	struct timeval a_start, a_end;
-	struct timeval s_start, s_end;
-	uint64_t c_time, a_time, s_time;
+	uint64_t t, query_start;
+	struct sigaction sa;
+	static const struct option long_opts[] = {
+		{ "repeat", required_argument, NULL, 'R' },
+		{ "deadline", required_argument, NULL, 'D' },
+		{ "max-steps", required_argument, NULL, 'N' },
+		{ "max-results", required_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	load_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (load_threads < 1) {
+		load_threads = 1;
+	} else if (load_threads > MAX_LOAD_THREADS) {
+		load_threads = MAX_LOAD_THREADS;
+	}
 
 	/*
 	 * TODO:
-	 * 1. use getopt() for options
-	 * 2. All word combinations (not just equal sized anagrams)
-	 * 3. Generate only word list
-	 * 4. Generate only anagrams
-	 * 5. Display time taken for different actions
-	 * 6. Accept alternate/additional word databases
+	 * 1. All word combinations (not just equal sized anagrams)
+	 * 2. Generate only word list
+	 * 3. Generate only anagrams
+	 * 4. Accept alternate/additional word databases
 	 */
-	if (argc != 2) {
+	while ((opt = getopt_long(argc, argv,
+	    "ab:cdD:gi:j:k:K:l:m:M:n:N:rR:stT:x:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			trie_mode = 1;
+			break;
+		case 'b':
+			batch_file = optarg;
+			break;
+		case 'c':
+			norm_flags &= ~NORM_FOLD_CASE;
+			break;
+		case 'd':
+			norm_flags |= NORM_STRIP_MARKS;
+			break;
+		case 'D':
+			budget.qb_time = strtoull(optarg, NULL, 10) * 1000000;
+			break;
+		case 'g':
+			class_mode = 1;
+			break;
+		case 'i':
+			if (limits.sl_nrequired == MAX_LISTED_WORDS) {
+				usage(argc, argv);
+			}
+			required[limits.sl_nrequired++] = optarg;
+			break;
+		case 'k':
+			kwords = atoi(optarg);
+			if (kwords < 1 || kwords > MAX_KWORDS) {
+				usage(argc, argv);
+			}
+			break;
+		case 'K':
+			best_k = atoi(optarg);
+			if (best_k < 1 || best_k > MAX_BEST) {
+				usage(argc, argv);
+			}
+			break;
+		case 'j':
+			load_threads = atoi(optarg);
+			if (load_threads < 1 ||
+			    load_threads > MAX_LOAD_THREADS) {
+				usage(argc, argv);
+			}
+			break;
+		case 'l':
+			limits.sl_min_len = atoi(optarg);
+			break;
+		case 'm':
+			limits.sl_min_words = atoi(optarg);
+			break;
+		case 'M':
+			limits.sl_max_words = atoi(optarg);
+			break;
+		case 'n':
+			budget.qb_max_results = strtoull(optarg, NULL, 10);
+			break;
+		case 'N':
+			budget.qb_max_steps = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			rarest_mode = 1;
+			break;
+		case 'R':
+			runs = atoi(optarg);
+			if (runs < 1 || runs > MAX_REPEAT) {
+				usage(argc, argv);
+			}
+			break;
+		case 'x':
+			if (limits.sl_nexcluded == MAX_LISTED_WORDS) {
+				usage(argc, argv);
+			}
+			excluded[limits.sl_nexcluded++] = optarg;
+			break;
+		case 's':
+			sub_word_mode = 1;
+			break;
+		case 't':
+			tree_mode = 1;
+			break;
+		case 'T':
+			score_table = optarg;
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+	if (optind != argc - (batch_file ? 0 : 1) ||
+	    (kwords && rarest_mode) ||
+	    (class_mode && (kwords || rarest_mode)) ||
+	    (best_k && (kwords || rarest_mode || class_mode))) {
 		usage(argc, argv);
 	}
+	input = batch_file ? "" : argv[optind];
+	if (kwords) {
+		/* Exactly kwords words, within any -m and -M given */
+		if (limits.sl_min_words < kwords) {
+			limits.sl_min_words = kwords;
+		}
+		if (limits.sl_max_words == 0 || limits.sl_max_words > kwords) {
+			limits.sl_max_words = kwords;
+		}
+	}
 
-	if (validate_input(argv[1]) != 0) {
+	/* Letters outside ASCII are classified by the UTF-8 C locale */
+	setlocale(LC_CTYPE, "C.UTF-8");
+	/* The first ^C ends the query cleanly, a second one the program */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sa, NULL);
+	if (validate_input(input) != 0) {
 		fprintf(stderr, "Non-alphabetic input. Exiting...\n");
 		exit(1);
 	}
 
+	t = now_nsec();
 	init_tree(&th);
 	populate_tree(&th);
+	t = end_phase(PHASE_LOAD, t);
+	if (best_k) {
+		load_letter_values(score_table);
+		init_word_scores();
+	}
+	if (sub_word_mode || kwords || trie_mode) {
+		build_sig_index(&th, &si);
+		if (trie_mode) {
+			build_sig_trie(&si, &trie);
+		}
+		end_phase(PHASE_INDEX, t);
+	}
 	init_stack();
 
-	while(1) {
+	if (batch_file) {
+		nbq = read_batch(batch_file, &bq);
+	} else if (encode_word(&alpha, input, copy) < 0) {
+		fprintf(stderr, "Input has letters the dictionary never "
+		    "uses. Exiting...\n");
+		exit(1);
+	}
+	for (i = 0; i < limits.sl_nrequired; i++) {
+		limits.sl_required[i] = encode_listed_word(required[i]);
+	}
+	for (i = 0; i < limits.sl_nexcluded; i++) {
+		limits.sl_excluded[i] = encode_listed_word(excluded[i]);
+	}
+
+	/* Every run after the first finds the dictionary warm in memory */
+	for (run = 0; run < runs; run++) {
 		//query_word_from_user(temp);
 		/* Using strcpy since the input is sanitized via fgets */
 		//strcpy(copy, temp);
-		strncpy(copy, argv[1], MAX_WORD_SIZE);
-
-		gettimeofday(&c_start, NULL);
-		get_all_permutations(&copy[0], strlen(copy));
-		gettimeofday(&c_end, NULL);
+		search_nodes = 0;
+		class_solutions = class_anagrams = 0;
+		tree_visits = 0;
+		trie.st_visits = 0;
+		query_start = t = now_nsec();
+		start_budget();
+		if (batch_file) {
+			run_batch(bq, nbq, rarest_mode, kwords, class_mode,
+			    best_k);
+			end_phase(PHASE_QUERY, query_start);
+			continue;
+		}
+		if (trie_mode) {
+			get_all_trie_sub_words(copy);
+		} else if (tree_mode) {
+			get_all_tree_sub_words(copy);
+		} else if (sub_word_mode) {
+			get_all_sub_words(copy);
+		} else {
+			get_all_permutations(&copy[0], strlen(copy));
+		}
+		t = end_phase(PHASE_COMBINATIONS, t);
 
-		gettimeofday(&s_start, NULL);
-		sort_word_list(word_list_head);
-		gettimeofday(&s_end, NULL);
+		sort_word_list(&word_list);
+		t = end_phase(PHASE_SORT, t);
 
 		printf("\n\nPrinting sorted wordlist..\n");
-		print_wordlist(word_list_head);
+		print_wordlist(&word_list);
+		fflush(stdout);
+		t = end_phase(PHASE_WORD_LIST, t);
 
 		printf("\n\nGenerating anagrams..\n");
-		gettimeofday(&a_start, NULL);
-		get_anagrams(word_list_head, strlen(copy), copy);
-		gettimeofday(&a_end, NULL);
+		search_anagrams(&word_list, copy, rarest_mode, kwords,
+		    class_mode, best_k);
+		end_budget();
+		fflush(stdout);
+		end_phase(PHASE_ANAGRAMS, t);
 
 		cleanup_lists();
-		break;
+		end_phase(PHASE_QUERY, query_start);
 	}
 
-	c_time = to_microsec(&c_end) - to_microsec(&c_start);
-	s_time = to_microsec(&s_end) - to_microsec(&s_start);
-	a_time = to_microsec(&a_end) - to_microsec(&a_start);
 	printf("\n\n");
-	fprintf(stderr, "time in microseconds for word combinations : %lu\n", c_time);
-	fprintf(stderr, "time in microseconds for sort : %lu\n", s_time);
-	fprintf(stderr, "time in microseconds for anagrams : %lu\n", a_time);
+	fflush(stdout);
+	print_phase_times();
+	if (batch_file) {
+		fprintf(stderr, "queries in batch : %d\n", nbq);
+	}
+	fprintf(stderr, "anagram search nodes : %lu\n", search_nodes);
+	if (class_mode) {
+		fprintf(stderr, "anagram classes : %lu solutions standing for "
+		    "%lu anagrams\n", class_solutions, class_anagrams);
+	}
+	print_bloom_stats(&th.th_bloom);
+	if (budget.qb_ntruncated) {
+		fprintf(stderr, "queries truncated : %d\n",
+		    budget.qb_ntruncated);
+	}
+	if (tree_mode && !batch_file) {
+		fprintf(stderr, "tree walk : %lu of %u nodes visited\n",
+		    tree_visits, th.th_nwords);
+	}
+	if (sub_word_mode || kwords || trie_mode) {
+		fprintf(stderr, "signature index : %u signatures, %lu probes, "
+		    "%lu hits\n", si.si_nsigs, si.si_probes, si.si_hits);
+	}
+	if (trie_mode && !batch_file) {
+		fprintf(stderr, "signature trie : %lu of %lu nodes visited\n",
+		    trie.st_visits, trie.st_nnodes);
+	}
 
 	return (0);
 }
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE	/* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#ifndef WORD_DB
+#define WORD_DB "/usr/share/dict/words"
+#endif
+#define MAX_WORD_SIZE 80
+#define MAX_THREADS 64
+#define DEFAULT_PROMPT "word: "
+
+/*
+ * Load generator for the interactive programs (wsearch, wsolver). Each
+ * worker thread starts its own copy of the engine, talks to it over a
+ * pair of pipes exactly as a user at the prompt would, and times every
+ * query from the moment it was due to be sent until the next prompt
+ * comes back. With a fixed rate (-r) queries are due on a schedule that
+ * does not wait for slow answers, so stalls show up in the latencies
+ * instead of being hidden by sending less.
+ *
+ * The query mix is either replayed from a file (-f, one query per line)
+ * or made up from the dictionary (-d): words picked at random, with a
+ * share of them turned into misses (-m), joined into two word phrases
+ * (-p) or scrambled for the solvers (-x).
+ */
+
+struct worker {
+	pthread_t w_thread;
+	int w_id;
+	pid_t w_pid;
+	int w_to;		/* engine's stdin */
+	int w_from;		/* engine's stdout */
+	char *w_buf;
+	size_t w_buf_size;
+	uint64_t *w_lat;	/* microseconds, one per query */
+	size_t w_nlat;
+	uint64_t w_errors;
+};
+
+typedef struct load_config {
+	char **lc_engine;	/* argv of the engine */
+	char *lc_prompt;
+	int lc_keep_stderr;
+	size_t lc_nqueries;	/* per run, over all threads */
+	double lc_rate;		/* queries/second over all threads, 0 = max */
+	int lc_nthreads;
+} load_config_t;
+
+/* Globals */
+char **queries;
+size_t nqueries;
+load_config_t config;
+pthread_barrier_t start_barrier;
+uint64_t start_time;
+uint64_t rand_state = 88172645463325252ULL;
+
+void
+usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s [-f <query file> | -d <dictionary>] "
+	    "[-q <synthetic queries>] [-m <miss %%>] [-p <phrase %%>] "
+	    "[-x] [-L <max length>] [-S <seed>] [-n <queries>] "
+	    "[-r <queries/sec>] [-t <threads,...>] [-P <prompt>] [-e] "
+	    "-- <engine> [engine args]\n"
+	    "\t-f : replay these queries, one per line\n"
+	    "\t-d : make up queries from this word list (default %s)\n"
+	    "\t-q : how many queries to make up (default 10000)\n"
+	    "\t-m : share of made up queries that are not words\n"
+	    "\t-p : share of made up queries that are two word phrases\n"
+	    "\t-x : scramble the letters of made up queries\n"
+	    "\t-L : longest made up query (default 10)\n"
+	    "\t-S : random seed for made up queries\n"
+	    "\t-n : queries per run (default: every query once)\n"
+	    "\t-r : send at this total rate instead of as fast as possible\n"
+	    "\t-t : thread counts to run with, one run each (default 1)\n"
+	    "\t-P : text the engine's prompt ends with (default \"%s\")\n"
+	    "\t-e : leave the engine's stderr attached\n"
+	    "The engine must read queries from a prompt, as wsearch and wsolver "
+	    "do;\nanagram takes its query from the command line and cannot be "
+	    "driven.\n",
+	    argv[0], WORD_DB, DEFAULT_PROMPT);
+	exit(1);
+}
+
+uint64_t
+now_microsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+/* xorshift64 */
+uint64_t
+next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (rand_state);
+}
+
+void
+add_query(char *str)
+{
+	static size_t size;
+
+	if (nqueries == size) {
+		size = size ? size * 2 : 1024;
+		if ((queries = realloc(queries, size * sizeof(char *))) ==
+		    NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	if ((queries[nqueries++] = strdup(str)) == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+}
+
+/* Read queries from path, one per line, skipping empty lines */
+void
+load_queries(char *path)
+{
+	FILE *fp;
+	char temp[MAX_WORD_SIZE];
+	size_t len;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(temp, sizeof(temp), fp) != NULL) {
+		len = strcspn(temp, "\r\n");
+		temp[len] = '\0';
+		if (len > 0) {
+			add_query(temp);
+		}
+	}
+	fclose(fp);
+}
+
+void
+scramble(char *str)
+{
+	int i, j, len = strlen(str);
+	char t;
+
+	for (i = len - 1; i > 0; i--) {
+		j = next_rand() % (i + 1);
+		t = str[i];
+		str[i] = str[j];
+		str[j] = t;
+	}
+}
+
+/*
+ * Make up count queries from the words in path. The length mix follows
+ * the dictionary's, since words are picked uniformly.
+ */
+void
+make_queries(char *path, size_t count, unsigned int miss_pct,
+    unsigned int phrase_pct, int scrambled, size_t maxlen)
+{
+	FILE *fp;
+	char **words = NULL;
+	size_t nwords = 0, size = 0, i;
+	char temp[MAX_WORD_SIZE], q[2 * MAX_WORD_SIZE];
+	size_t len, j;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fscanf(fp, "%79s", temp) == 1) {
+		len = strlen(temp);
+		for (j = 0; j < len && isalpha((unsigned char)temp[j]); j++)
+			;
+		if (j < len || len > maxlen) {
+			continue;
+		}
+		if (nwords == size) {
+			size = size ? size * 2 : 1024;
+			if ((words = realloc(words, size * sizeof(char *))) ==
+			    NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		if ((words[nwords++] = strdup(temp)) == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+	}
+	fclose(fp);
+	if (nwords == 0) {
+		fprintf(stderr, "No usable words in %s\n", path);
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		strcpy(q, words[next_rand() % nwords]);
+		if (next_rand() % 100 < phrase_pct) {
+			/* A second word, if it still fits */
+			strcpy(temp, words[next_rand() % nwords]);
+			if (strlen(q) + strlen(temp) <= maxlen) {
+				strcat(q, temp);
+			}
+		}
+		if (next_rand() % 100 < miss_pct) {
+			/* Almost surely not a word any more */
+			len = strlen(q);
+			for (j = 0; j < (len + 2) / 3; j++) {
+				q[next_rand() % len] = 'q' + next_rand() % 10;
+			}
+		}
+		if (scrambled) {
+			scramble(q);
+		}
+		add_query(q);
+	}
+	for (i = 0; i < nwords; i++) {
+		free(words[i]);
+	}
+	free(words);
+}
+
+/* Start the engine for w, wired to a pair of pipes */
+void
+start_engine(struct worker *w)
+{
+	int to[2], from[2], fd;
+
+	/*
+	 * Close-on-exec, or engines started by the other workers would
+	 * hold this engine's stdin open and it would never see EOF.
+	 */
+	if (pipe2(to, O_CLOEXEC) != 0 || pipe2(from, O_CLOEXEC) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((w->w_pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (w->w_pid == 0) {
+		dup2(to[0], 0);
+		dup2(from[1], 1);
+		if (!config.lc_keep_stderr &&
+		    (fd = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(fd, 2);
+			close(fd);
+		}
+		close(to[0]);
+		close(to[1]);
+		close(from[0]);
+		close(from[1]);
+		execvp(config.lc_engine[0], config.lc_engine);
+		perror(config.lc_engine[0]);
+		_exit(127);
+	}
+	close(to[0]);
+	close(from[1]);
+	w->w_to = to[1];
+	w->w_from = from[0];
+}
+
+void
+stop_engine(struct worker *w)
+{
+	int status;
+
+	close(w->w_to);
+	close(w->w_from);
+	waitpid(w->w_pid, &status, 0);
+}
+
+/*
+ * Read the engine's output up to and including its next prompt.
+ * Returns -1 if the engine went away first.
+ */
+int
+wait_for_prompt(struct worker *w)
+{
+	size_t len = 0, plen = strlen(config.lc_prompt);
+	ssize_t n;
+
+	for (;;) {
+		if (len == w->w_buf_size) {
+			w->w_buf_size = w->w_buf_size ? w->w_buf_size * 2 :
+			    4096;
+			if ((w->w_buf = realloc(w->w_buf, w->w_buf_size)) ==
+			    NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		n = read(w->w_from, w->w_buf + len, w->w_buf_size - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return (-1);
+		}
+		len += n;
+		if (len >= plen && memcmp(w->w_buf + len - plen,
+		    config.lc_prompt, plen) == 0) {
+			return (0);
+		}
+	}
+}
+
+int
+send_query(struct worker *w, char *str)
+{
+	char temp[MAX_WORD_SIZE + 1];
+	int len = snprintf(temp, sizeof(temp), "%s\n", str);
+
+	return (write(w->w_to, temp, len) == len ? 0 : -1);
+}
+
+/* Worker w sends queries w_id, w_id + nthreads, ... of the run */
+void *
+run_worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t due, done, interval = 0;
+	size_t i, k;
+	int ok;
+
+	start_engine(w);
+	/* The first prompt means the dictionary is loaded */
+	ok = (wait_for_prompt(w) == 0);
+	/* Once to say we are ready, once more for start_time to be set */
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	if (!ok) {
+		w->w_errors++;
+		return (NULL);
+	}
+	if (config.lc_rate > 0) {
+		interval = 1e6 / config.lc_rate * config.lc_nthreads;
+	}
+
+	for (i = w->w_id, k = 0; i < config.lc_nqueries;
+	    i += config.lc_nthreads, k++) {
+		if (interval) {
+			/* Query i is due i / rate in, so workers take turns */
+			due = start_time + interval * k +
+			    w->w_id * interval / config.lc_nthreads;
+			done = now_microsec();
+			if (due > done) {
+				usleep(due - done);
+			}
+		} else {
+			due = now_microsec();
+		}
+		if (send_query(w, queries[i % nqueries]) != 0 ||
+		    wait_for_prompt(w) != 0) {
+			w->w_errors++;
+			break;
+		}
+		done = now_microsec();
+		w->w_lat[w->w_nlat++] = done - due;
+	}
+	return (NULL);
+}
+
+int
+lat_compare(const void *a, const void *b)
+{
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+uint64_t
+percentile(uint64_t *lat, size_t n, double p)
+{
+	size_t rank;
+
+	if (n == 0) {
+		return (0);
+	}
+	rank = p * n;
+	return (lat[rank < n ? rank : n - 1]);
+}
+
+/* One run with nthreads engines; prints a line of results */
+void
+run_load(int nthreads)
+{
+	struct worker workers[MAX_THREADS];
+	uint64_t *lat, errors = 0, end_time;
+	size_t n = 0, per_thread;
+	double secs;
+	int i;
+
+	config.lc_nthreads = nthreads;
+	per_thread = config.lc_nqueries / nthreads + 1;
+	memset(workers, 0, sizeof(workers));
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		workers[i].w_id = i;
+		workers[i].w_lat = malloc(per_thread * sizeof(uint64_t));
+		if (workers[i].w_lat == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		if (pthread_create(&workers[i].w_thread, NULL, run_worker,
+		    &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	/* Start the clock once every engine is ready */
+	pthread_barrier_wait(&start_barrier);
+	start_time = now_microsec();
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].w_thread, NULL);
+	}
+	end_time = now_microsec();
+	for (i = 0; i < nthreads; i++) {
+		stop_engine(&workers[i]);
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	if ((lat = malloc(config.lc_nqueries * sizeof(uint64_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		memcpy(lat + n, workers[i].w_lat,
+		    workers[i].w_nlat * sizeof(uint64_t));
+		n += workers[i].w_nlat;
+		errors += workers[i].w_errors;
+		free(workers[i].w_lat);
+		free(workers[i].w_buf);
+	}
+	qsort(lat, n, sizeof(uint64_t), lat_compare);
+
+	secs = (end_time - start_time) / 1e6;
+	printf("%7d %9lu %8.3f %10.1f %8lu %8lu %8lu %8lu %8lu %6lu\n",
+	    nthreads, n, secs, secs > 0 ? n / secs : 0.0,
+	    percentile(lat, n, 0.5), percentile(lat, n, 0.9),
+	    percentile(lat, n, 0.99), percentile(lat, n, 0.999),
+	    n ? lat[n - 1] : 0, errors);
+	fflush(stdout);
+	free(lat);
+}
+
+int
+main(int argc, char **argv)
+{
+	int threads[MAX_THREADS];
+	int nruns = 0, i, opt;
+	int miss_pct = 0, phrase_pct = 0, scrambled = 0, maxlen = 10;
+	size_t synthetic = 10000;
+	char *query_file = NULL, *dict = WORD_DB, *p;
+
+	config.lc_prompt = DEFAULT_PROMPT;
+	while ((opt = getopt(argc, argv, "d:ef:L:m:n:p:P:q:r:S:t:x")) != -1) {
+		switch (opt) {
+		case 'd':
+			dict = optarg;
+			break;
+		case 'e':
+			config.lc_keep_stderr = 1;
+			break;
+		case 'f':
+			query_file = optarg;
+			break;
+		case 'L':
+			maxlen = atoi(optarg);
+			if (maxlen < 1 || maxlen >= MAX_WORD_SIZE) {
+				usage(argc, argv);
+			}
+			break;
+		case 'm':
+			miss_pct = atoi(optarg);
+			if (miss_pct < 0 || miss_pct > 100) {
+				usage(argc, argv);
+			}
+			break;
+		case 'n':
+			config.lc_nqueries = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			phrase_pct = atoi(optarg);
+			if (phrase_pct < 0 || phrase_pct > 100) {
+				usage(argc, argv);
+			}
+			break;
+		case 'P':
+			config.lc_prompt = optarg;
+			break;
+		case 'q':
+			synthetic = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			config.lc_rate = atof(optarg);
+			break;
+		case 'S':
+			rand_state = strtoull(optarg, NULL, 10) | 1;
+			break;
+		case 't':
+			for (p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+				if (nruns == MAX_THREADS) {
+					usage(argc, argv);
+				}
+				threads[nruns] = atoi(p);
+				if (threads[nruns] < 1 ||
+				    threads[nruns] > MAX_THREADS) {
+					usage(argc, argv);
+				}
+				nruns++;
+			}
+			break;
+		case 'x':
+			scrambled = 1;
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+	if (optind == argc || strlen(config.lc_prompt) == 0) {
+		usage(argc, argv);
+	}
+	config.lc_engine = &argv[optind];
+	if (nruns == 0) {
+		threads[nruns++] = 1;
+	}
+
+	if (query_file) {
+		load_queries(query_file);
+	} else {
+		make_queries(dict, synthetic, miss_pct, phrase_pct, scrambled,
+		    maxlen);
+	}
+	if (nqueries == 0) {
+		fprintf(stderr, "No queries to send\n");
+		exit(1);
+	}
+	if (config.lc_nqueries == 0) {
+		config.lc_nqueries = nqueries;
+	}
+	/* An engine that exits early must not take us down with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("threads   queries  seconds        qps      p50      p90"
+	    "      p99     p999      max errors\n");
+	printf("(latencies in microseconds, engine load time excluded)\n");
+	for (i = 0; i < nruns; i++) {
+		run_load(threads[i]);
+	}
+	return (0);
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define MAX_WORD_SIZE 80
+#define BYTES_PER_LINE 64
+
+/*
+ * Turn a word list into a C header that wsearch and wsolver can be
+ * built against with -DEMBEDDED_DB, so that they carry the dictionary
+ * in their read-only data and never open WORD_DB. The header holds:
+ *
+ *   embedded_text[]  - every word followed by a newline, in file order,
+ *                      i.e. the word list as the programs would read it
+ *   embedded_index[] - offsets of the distinct words in embedded_text,
+ *                      sorted by strcmp(), for binary searching
+ */
+
+char *text;
+size_t text_len;
+
+void
+usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s <word list> > words_db.h\n", argv[0]);
+	exit(1);
+}
+
+/* strcmp() for two newline terminated words in text */
+int
+word_compare(const void *a, const void *b)
+{
+	const unsigned char *x = (unsigned char *)text + *(uint32_t *)a;
+	const unsigned char *y = (unsigned char *)text + *(uint32_t *)b;
+
+	for (; *x == *y && *x != '\n'; x++, y++)
+		;
+	if (*x == *y) {
+		return (0);
+	}
+	return ((*x == '\n' ? 0 : *x) - (*y == '\n' ? 0 : *y));
+}
+
+/* Read the word list, keeping each word on a line of its own */
+void
+read_words(char *path)
+{
+	FILE *fp;
+	size_t size = 0;
+	int c, len = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	text_len = 0;
+	while (1) {
+		c = getc(fp);
+		if (text_len + 2 > size) {
+			size = size ? size * 2 : 1 << 16;
+			if ((text = realloc(text, size)) == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		if (c != EOF && !isspace(c)) {
+			text[text_len++] = c;
+			len++;
+			continue;
+		}
+		if (len >= MAX_WORD_SIZE) {
+			fprintf(stderr, "skipping word longer than %d "
+			    "bytes\n", MAX_WORD_SIZE - 1);
+			text_len -= len;
+		} else if (len > 0) {
+			text[text_len++] = '\n';
+		}
+		len = 0;
+		if (c == EOF) {
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t *index;
+	size_t i, nwords, nunique;
+	int c, col;
+
+	if (argc != 2) {
+		usage(argc, argv);
+	}
+	read_words(argv[1]);
+
+	for (i = 0, nwords = 0; i < text_len; i++) {
+		nwords += (text[i] == '\n');
+	}
+	if ((index = malloc((nwords + 1) * sizeof(uint32_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0, nwords = 0; i < text_len; i++) {
+		if (i == 0 || text[i - 1] == '\n') {
+			index[nwords++] = i;
+		}
+	}
+	qsort(index, nwords, sizeof(uint32_t), word_compare);
+	for (i = 0, nunique = 0; i < nwords; i++) {
+		if (nunique == 0 ||
+		    word_compare(&index[nunique - 1], &index[i]) != 0) {
+			index[nunique++] = index[i];
+		}
+	}
+
+	printf("/* Generated by mkwordsdb from %s. Do not edit. */\n\n",
+	    argv[1]);
+	printf("#define EMBEDDED_NWORDS %lu\n\n", nunique);
+
+	printf("static const char embedded_text[] =");
+	for (i = 0, col = BYTES_PER_LINE; i < text_len; i++, col++) {
+		if (col == BYTES_PER_LINE) {
+			printf("%s\n    \"", i ? "\"" : "");
+			col = 0;
+		}
+		c = (unsigned char)text[i];
+		if (c == '"' || c == '\\' || c == '?') {
+			printf("\\%c", c);
+		} else if (c == '\n') {
+			printf("\\n");
+		} else if (isprint(c)) {
+			putchar(c);
+		} else {
+			printf("\\%03o", c);
+		}
+	}
+	printf("%s;\n\n", text_len ? "\"" : " \"\"");
+
+	printf("static const uint32_t embedded_index[] = {");
+	for (i = 0; i < nunique; i++) {
+		printf("%s%u,", i % 8 ? " " : "\n    ", index[i]);
+	}
+	/* Keep the array non-empty for an empty word list */
+	printf("%s\n};\n", nunique ? "" : "\n    0");
+
+	free(index);
+	free(text);
+	return (0);
+}
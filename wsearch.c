@@ -2,13 +2,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "tree.h"
 
 #define ASSERT(cond) {if (!(cond)) (*((char *)0) = 0);}
 
+#ifndef WORD_DB
 #define WORD_DB "/usr/share/dict/words"
+#endif
 #define MAX_WORD_SIZE 80
+#define MAX_FUZZY_DIST 2
+#define MAX_SUGGESTIONS 32
+
+/*
+ * -DEMBEDDED_DB builds take the dictionary from words_db.h, generated by
+ * mkwordsdb, instead of reading WORD_DB at run time.
+ */
+#ifdef EMBEDDED_DB
+#include "words_db.h"
+#define EMBEDDED 1
+#else
+#define EMBEDDED 0
+#define EMBEDDED_NWORDS 0
+static const char embedded_text[] = "";
+static const uint32_t embedded_index[] = { 0 };
+#endif
+
+/* A variable, so the bounds checks below stay sane when there are no words */
+static const uint32_t embedded_nwords = EMBEDDED_NWORDS;
 
 struct word_node {
 	char *word;
@@ -19,8 +43,61 @@ typedef struct word_node wnode_t;
 
 typedef struct tree_handle {
 	RB_HEAD(word_tree, word_node) th_tree;
+	uint32_t th_nwords;
 } tree_handle_t;
 
+/* One token of a bulk query file */
+struct bulk_query {
+	char *bq_word;
+	uint32_t bq_found;
+};
+
+/*
+ * Front-coded dictionary, used instead of the tree with -c. The sorted
+ * word list is cut into blocks of FC_BLOCK_WORDS words. The first word of
+ * a block is stored whole; each following word is stored as one byte
+ * giving the length of the prefix it shares with its predecessor and the
+ * NUL terminated remainder. fc_blocks[] is the sparse index of block
+ * offsets, searched by binary search on the block head words.
+ */
+#define FC_BLOCK_WORDS 16
+
+typedef struct fc_dict {
+	char *fc_data;
+	size_t fc_len;
+	uint32_t *fc_blocks;
+	uint32_t fc_nblocks;
+	uint32_t fc_nwords;
+} fc_dict_t;
+
+/*
+ * Symmetric-delete index for fuzzy lookups. Every dictionary word
+ * contributes itself plus every string obtained by deleting up to
+ * fi_maxdist of its characters. Only a 32-bit hash of each delete is
+ * kept; a hash collision merely produces an extra candidate, which the
+ * final edit distance check throws away.
+ */
+struct fuzzy_entry {
+	uint32_t fe_hash;
+	uint32_t fe_word;
+};
+
+typedef struct fuzzy_index {
+	int fi_maxdist;
+	uint32_t fi_nwords;
+	char **fi_words;		/* sorted, points into the tree nodes */
+	struct fuzzy_entry *fi_entries;	/* sorted by (fe_hash, fe_word) */
+	size_t fi_nentries;
+	size_t fi_size;
+	uint32_t *fi_seen;		/* per-word stamp to dedup candidates */
+	uint32_t fi_stamp;
+} fuzzy_index_t;
+
+struct suggestion {
+	char *word;
+	int dist;
+};
+
 int
 str_compare(const void *query_key, const void *cur)
 {
@@ -43,7 +120,10 @@ RB_GENERATE(word_tree, word_node, rb_node, str_compare);
 wnode_t *get_node(char *str)
 {
 	wnode_t *w = ((wnode_t *) malloc(sizeof(wnode_t)));
-	w->word = malloc(strlen(str));
+	if (w == NULL || (w->word = malloc(strlen(str) + 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
 	strcpy(w->word, str);
 	return (w);
 }
@@ -52,6 +132,7 @@ void
 init_tree(tree_handle_t *handle)
 {
 	RB_INIT(&handle->th_tree);
+	handle->th_nwords = 0;
 }
 
 int
@@ -66,10 +147,12 @@ add_word_to_tree(tree_handle_t *handle, char *add_str)
 
 	if (RB_FIND(word_tree, &handle->th_tree, node) != NULL) {
 		/* Node already present */
+		free(node->word);
 		free(node);
 		ret = EEXIST;
 	} else {
 		RB_INSERT(word_tree, &handle->th_tree, (void *)node);
+		handle->th_nwords++;
 	}
 
 	return (ret);
@@ -95,6 +178,17 @@ search_word_in_tree(tree_handle_t *handle, char *search_str)
 	return (ret);
 }
 
+/* Open the word list, the compiled-in copy in EMBEDDED builds */
+FILE *
+open_word_db(void)
+{
+	if (EMBEDDED) {
+		return (fmemopen((void *)embedded_text,
+		    sizeof(embedded_text) - 1, "r"));
+	}
+	return (fopen(WORD_DB, "r"));
+}
+
 int
 populate_tree(tree_handle_t *tree)
 {
@@ -102,7 +196,7 @@ populate_tree(tree_handle_t *tree)
 	FILE *fp;
 	char temp[MAX_WORD_SIZE];
 
-	fp = fopen(WORD_DB, "r");
+	fp = open_word_db();
 	if (fp == NULL) {
 		fprintf(stderr, "Could not open word database at : %s\n",
 		    WORD_DB);
@@ -120,38 +214,900 @@ populate_tree(tree_handle_t *tree)
 	return (0);
 }
 
+int
+word_compare(const void *a, const void *b)
+{
+	return (strcmp(*(char **)a, *(char **)b));
+}
+
+/*
+ * Load WORD_DB straight into a front-coded dictionary. The words are
+ * gathered in one flat buffer, sorted and then encoded block by block,
+ * after which only the encoding and the block index are kept.
+ */
+void
+fc_build(fc_dict_t *fc)
+{
+	FILE *fp;
+	char temp[MAX_WORD_SIZE];
+	char *pool = NULL, **words, *prev, *w;
+	size_t pool_len = 0, pool_size = 0, nwords = 0, off, i, need;
+	uint32_t nblocks = 0;
+	int shared;
+
+	fp = open_word_db();
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open word database at : %s\n",
+		    WORD_DB);
+		exit(1);
+	}
+	while(fscanf(fp, "%s", temp) != EOF) {
+		need = strlen(temp) + 1;
+		if (pool_len + need > pool_size) {
+			pool_size = pool_size ? pool_size * 2 : 1 << 20;
+			pool = realloc(pool, pool_size);
+			if (pool == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		memcpy(pool + pool_len, temp, need);
+		pool_len += need;
+		nwords++;
+	}
+	fclose(fp);
+
+	words = malloc((nwords ? nwords : 1) * sizeof(char *));
+	if (words == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0, off = 0; i < nwords; i++) {
+		words[i] = pool + off;
+		off += strlen(pool + off) + 1;
+	}
+	qsort(words, nwords, sizeof(char *), word_compare);
+
+	/* Every word may cost one prefix-length byte on top of its text */
+	memset(fc, 0, sizeof(fc_dict_t));
+	fc->fc_data = malloc(pool_len + nwords + 1);
+	fc->fc_blocks = malloc((nwords / FC_BLOCK_WORDS + 1) *
+	    sizeof(uint32_t));
+	if (fc->fc_data == NULL || fc->fc_blocks == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0, prev = NULL; i < nwords; i++) {
+		w = words[i];
+		if (prev && strcmp(prev, w) == 0) {
+			fprintf(stderr, "%s already in tree\n", w);
+			continue;
+		}
+		if (fc->fc_nwords % FC_BLOCK_WORDS == 0) {
+			fc->fc_blocks[nblocks++] = fc->fc_len;
+		} else {
+			for (shared = 0; prev[shared] == w[shared]; shared++)
+				;
+			fc->fc_data[fc->fc_len++] = shared;
+			w += shared;
+		}
+		need = strlen(w) + 1;
+		memcpy(fc->fc_data + fc->fc_len, w, need);
+		fc->fc_len += need;
+		fc->fc_nwords++;
+		prev = words[i];
+	}
+	fc->fc_nblocks = nblocks;
+
+	fc->fc_data = realloc(fc->fc_data, fc->fc_len ? fc->fc_len : 1);
+	fc->fc_blocks = realloc(fc->fc_blocks,
+	    (nblocks ? nblocks : 1) * sizeof(uint32_t));
+	free(words);
+	free(pool);
+}
+
+size_t
+fc_bytes(fc_dict_t *fc)
+{
+	return (fc->fc_len + fc->fc_nblocks * sizeof(uint32_t) +
+	    sizeof(fc_dict_t));
+}
+
+/*
+ * Index of the last block whose head word is <= str, or 0 if str sorts
+ * before every word.
+ */
+uint32_t
+fc_find_block(fc_dict_t *fc, char *str)
+{
+	uint32_t lo = 0, hi = fc->fc_nblocks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(fc->fc_data + fc->fc_blocks[mid], str) <= 0) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+/*
+ * Decode the words of the dictionary in order, starting at the head of
+ * block b, until fn() returns non zero or the dictionary runs out.
+ */
+void
+fc_walk(fc_dict_t *fc, uint32_t b, int (*fn)(char *, void *), void *arg)
+{
+	char word[MAX_WORD_SIZE];
+	char *p;
+	uint32_t n;
+	size_t len;
+
+	if (b >= fc->fc_nblocks) {
+		return;
+	}
+	p = fc->fc_data + fc->fc_blocks[b];
+	for (n = b * FC_BLOCK_WORDS; n < fc->fc_nwords; n++) {
+		if (n % FC_BLOCK_WORDS == 0) {
+			len = 0;
+		} else {
+			len = (unsigned char)*p++;
+		}
+		strcpy(word + len, p);
+		p += strlen(p) + 1;
+		if (fn(word, arg) != 0) {
+			return;
+		}
+	}
+}
+
+struct fc_lookup {
+	char *fl_word;
+	int fl_found;
+};
+
+int
+fc_match_word(char *word, void *arg)
+{
+	struct fc_lookup *fl = arg;
+	int cmp = strcmp(word, fl->fl_word);
+
+	if (cmp == 0) {
+		fl->fl_found = 1;
+	}
+	/* Words come in sorted order; stop once we are past the query */
+	return (cmp >= 0);
+}
+
+int
+fc_search(fc_dict_t *fc, char *search_str)
+{
+	struct fc_lookup fl;
+
+	fl.fl_word = search_str;
+	fl.fl_found = 0;
+	fc_walk(fc, fc_find_block(fc, search_str), fc_match_word, &fl);
+	return (fl.fl_found ? 0 : ENOENT);
+}
+
+int
+print_if_prefixed(char *word, void *arg)
+{
+	char *prefix = arg;
+	int cmp = strncmp(word, prefix, strlen(prefix));
+
+	if (cmp == 0) {
+		printf("%s\n", word);
+	}
+	return (cmp > 0);
+}
+
+void
+fc_prefix_search(fc_dict_t *fc, char *prefix)
+{
+	fc_walk(fc, fc_find_block(fc, prefix), print_if_prefixed, prefix);
+}
+
+void
+tree_prefix_search(tree_handle_t *handle, char *prefix)
+{
+	wnode_t temp, *node;
+
+	memset((void *)&temp, 0, sizeof(wnode_t));
+	temp.word = prefix;
+
+	for (node = RB_NFIND(word_tree, &handle->th_tree, &temp); node;
+	    node = RB_NEXT(word_tree, &handle->th_tree, node)) {
+		if (print_if_prefixed(node->word, prefix) != 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * Compare str with the first n bytes of the newline terminated word at
+ * off in embedded_text, like strncmp().
+ */
+int
+embedded_compare(const char *str, uint32_t off, size_t n)
+{
+	const unsigned char *x = (const unsigned char *)str;
+	const unsigned char *y = (const unsigned char *)embedded_text + off;
+	int cy;
+
+	for (; n > 0; x++, y++, n--) {
+		cy = (*y == '\n') ? 0 : *y;
+		if (*x != cy || *x == 0) {
+			return (*x - cy);
+		}
+	}
+	return (0);
+}
+
+/* Index of the first embedded word >= str */
+uint32_t
+embedded_lower_bound(const char *str)
+{
+	uint32_t lo = 0, hi = embedded_nwords, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (embedded_compare(str, embedded_index[mid],
+		    MAX_WORD_SIZE) > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+int
+embedded_search(char *search_str)
+{
+	uint32_t i = embedded_lower_bound(search_str);
+
+	if (i < embedded_nwords && embedded_compare(search_str,
+	    embedded_index[i], MAX_WORD_SIZE) == 0) {
+		return (0);
+	}
+	return (ENOENT);
+}
+
+void
+embedded_prefix_search(char *prefix)
+{
+	size_t len = strlen(prefix);
+	uint32_t i;
+	const char *w;
+
+	for (i = embedded_lower_bound(prefix); i < embedded_nwords &&
+	    embedded_compare(prefix, embedded_index[i], len) == 0; i++) {
+		w = embedded_text + embedded_index[i];
+		printf("%.*s\n", (int)(strchr(w, '\n') - w), w);
+	}
+}
+
+uint64_t
+to_microsec(struct timeval *tv)
+{
+	return (tv->tv_sec * 1000000L + tv->tv_usec);
+}
+
+/* FNV-1a over the first len bytes of str */
+uint32_t
+hash_str(const char *str, int len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+void
+add_fuzzy_entry(fuzzy_index_t *fi, uint32_t hash, uint32_t word)
+{
+	if (fi->fi_nentries == fi->fi_size) {
+		fi->fi_size = fi->fi_size ? fi->fi_size * 2 : 1024;
+		fi->fi_entries = realloc(fi->fi_entries,
+		    fi->fi_size * sizeof(struct fuzzy_entry));
+		if (fi->fi_entries == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	fi->fi_entries[fi->fi_nentries].fe_hash = hash;
+	fi->fi_entries[fi->fi_nentries].fe_word = word;
+	fi->fi_nentries++;
+}
+
+/*
+ * Call fn() on str and on every string obtained by deleting up to depth of
+ * its characters. Deletions are made at non-decreasing positions so that
+ * most duplicates (but not those caused by repeated letters) are avoided.
+ */
+void
+for_each_delete(char *str, int len, int start, int depth,
+    void (*fn)(fuzzy_index_t *, char *, int, void *), fuzzy_index_t *fi,
+    void *arg)
+{
+	char buf[MAX_WORD_SIZE];
+	int i;
+
+	fn(fi, str, len, arg);
+	if (depth == 0) {
+		return;
+	}
+	for (i = start; i < len; i++) {
+		memcpy(buf, str, i);
+		memcpy(buf + i, str + i + 1, len - i - 1);
+		for_each_delete(buf, len - 1, i, depth - 1, fn, fi, arg);
+	}
+}
+
+void
+index_delete(fuzzy_index_t *fi, char *str, int len, void *arg)
+{
+	add_fuzzy_entry(fi, hash_str(str, len), *(uint32_t *)arg);
+}
+
+int
+fuzzy_entry_compare(const void *a, const void *b)
+{
+	const struct fuzzy_entry *x = a, *y = b;
+
+	if (x->fe_hash != y->fe_hash) {
+		return (x->fe_hash < y->fe_hash ? -1 : 1);
+	}
+	if (x->fe_word != y->fe_word) {
+		return (x->fe_word < y->fe_word ? -1 : 1);
+	}
+	return (0);
+}
+
+/* Flatten the tree into an array of its words in sorted order */
+char **
+get_sorted_words(tree_handle_t *handle)
+{
+	wnode_t *node;
+	char **words;
+	uint32_t n = 0;
+
+	words = malloc((handle->th_nwords ? handle->th_nwords : 1) *
+	    sizeof(char *));
+	if (words == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	RB_FOREACH(node, word_tree, &handle->th_tree) {
+		words[n++] = node->word;
+	}
+	return (words);
+}
+
+void
+build_fuzzy_index(tree_handle_t *handle, fuzzy_index_t *fi, int maxdist)
+{
+	size_t i, j;
+	uint32_t n;
+
+	memset(fi, 0, sizeof(fuzzy_index_t));
+	fi->fi_maxdist = maxdist;
+	fi->fi_words = get_sorted_words(handle);
+	fi->fi_nwords = handle->th_nwords;
+	fi->fi_seen = calloc(handle->th_nwords ? handle->th_nwords : 1,
+	    sizeof(uint32_t));
+	if (fi->fi_seen == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (n = 0; n < fi->fi_nwords; n++) {
+		for_each_delete(fi->fi_words[n], strlen(fi->fi_words[n]), 0,
+		    maxdist, index_delete, fi, &n);
+	}
+
+	qsort(fi->fi_entries, fi->fi_nentries, sizeof(struct fuzzy_entry),
+	    fuzzy_entry_compare);
+
+	/* Drop duplicate (hash, word) pairs caused by repeated letters */
+	for (i = j = 0; i < fi->fi_nentries; i++) {
+		if (j == 0 || fuzzy_entry_compare(&fi->fi_entries[j - 1],
+		    &fi->fi_entries[i]) != 0) {
+			fi->fi_entries[j++] = fi->fi_entries[i];
+		}
+	}
+	fi->fi_nentries = j;
+	fi->fi_entries = realloc(fi->fi_entries,
+	    j * sizeof(struct fuzzy_entry));
+	fi->fi_size = j;
+}
+
+size_t
+fuzzy_index_bytes(fuzzy_index_t *fi)
+{
+	return (fi->fi_size * sizeof(struct fuzzy_entry) +
+	    fi->fi_nwords * (sizeof(char *) + sizeof(uint32_t)));
+}
+
+/*
+ * Damerau-Levenshtein distance (optimal string alignment variant) between
+ * a and b. Gives up early and returns limit + 1 once every cell of a row
+ * exceeds limit.
+ */
+int
+edit_distance(const char *a, int alen, const char *b, int blen, int limit)
+{
+	int d[MAX_WORD_SIZE + 1][MAX_WORD_SIZE + 1];
+	int i, j, cost, v, rowmin;
+
+	for (i = 0; i <= alen; i++) {
+		d[i][0] = i;
+	}
+	for (j = 0; j <= blen; j++) {
+		d[0][j] = j;
+	}
+	for (i = 1; i <= alen; i++) {
+		rowmin = d[i][0];
+		for (j = 1; j <= blen; j++) {
+			cost = (a[i - 1] == b[j - 1]) ? 0 : 1;
+			v = d[i - 1][j - 1] + cost;
+			if (d[i - 1][j] + 1 < v) {
+				v = d[i - 1][j] + 1;
+			}
+			if (d[i][j - 1] + 1 < v) {
+				v = d[i][j - 1] + 1;
+			}
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+			    a[i - 2] == b[j - 1] && d[i - 2][j - 2] + 1 < v) {
+				v = d[i - 2][j - 2] + 1;
+			}
+			d[i][j] = v;
+			if (v < rowmin) {
+				rowmin = v;
+			}
+		}
+		if (rowmin > limit) {
+			return (limit + 1);
+		}
+	}
+	return (d[alen][blen]);
+}
+
+struct fuzzy_query {
+	char *fq_word;
+	int fq_len;
+	struct suggestion fq_sugg[MAX_SUGGESTIONS];
+	int fq_nsugg;
+	int fq_nfound;		/* matches seen, fq_nsugg of them kept */
+};
+
+void
+add_suggestion(struct fuzzy_query *fq, char *word, int dist)
+{
+	int i, worst = 0;
+
+	fq->fq_nfound++;
+	if (fq->fq_nsugg < MAX_SUGGESTIONS) {
+		fq->fq_sugg[fq->fq_nsugg].word = word;
+		fq->fq_sugg[fq->fq_nsugg].dist = dist;
+		fq->fq_nsugg++;
+		return;
+	}
+
+	/* Full. Replace the most distant suggestion if this one is closer */
+	for (i = 1; i < fq->fq_nsugg; i++) {
+		if (fq->fq_sugg[i].dist > fq->fq_sugg[worst].dist) {
+			worst = i;
+		}
+	}
+	if (dist < fq->fq_sugg[worst].dist) {
+		fq->fq_sugg[worst].word = word;
+		fq->fq_sugg[worst].dist = dist;
+	}
+}
+
+void
+probe_delete(fuzzy_index_t *fi, char *str, int len, void *arg)
+{
+	struct fuzzy_query *fq = arg;
+	struct fuzzy_entry *e;
+	size_t lo = 0, hi = fi->fi_nentries, mid;
+	uint32_t h = hash_str(str, len);
+	char *w;
+	int wlen, dist;
+
+	/* Find the first entry with fe_hash == h */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fi->fi_entries[mid].fe_hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (e = &fi->fi_entries[lo];
+	    e < &fi->fi_entries[fi->fi_nentries] && e->fe_hash == h; e++) {
+		if (fi->fi_seen[e->fe_word] == fi->fi_stamp) {
+			continue;
+		}
+		fi->fi_seen[e->fe_word] = fi->fi_stamp;
+		w = fi->fi_words[e->fe_word];
+		wlen = strlen(w);
+		if (abs(wlen - fq->fq_len) > fi->fi_maxdist) {
+			continue;
+		}
+		dist = edit_distance(fq->fq_word, fq->fq_len, w, wlen,
+		    fi->fi_maxdist);
+		if (dist <= fi->fi_maxdist) {
+			add_suggestion(fq, w, dist);
+		}
+	}
+}
+
+int
+suggestion_compare(const void *a, const void *b)
+{
+	const struct suggestion *x = a, *y = b;
+
+	if (x->dist != y->dist) {
+		return (x->dist - y->dist);
+	}
+	return (strcmp(x->word, y->word));
+}
+
+/*
+ * Collect the dictionary words within fi_maxdist edits of word into fq,
+ * closest first. Only the MAX_SUGGESTIONS closest are kept; fq_nfound
+ * counts them all.
+ */
+int
+fuzzy_search(fuzzy_index_t *fi, char *word, struct fuzzy_query *fq)
+{
+	fq->fq_word = word;
+	fq->fq_len = strlen(word);
+	fq->fq_nsugg = 0;
+	fq->fq_nfound = 0;
+
+	if (++fi->fi_stamp == 0) {
+		/* Stamp wrapped around. Start afresh */
+		memset(fi->fi_seen, 0, fi->fi_nwords * sizeof(uint32_t));
+		fi->fi_stamp = 1;
+	}
+
+	for_each_delete(word, fq->fq_len, 0, fi->fi_maxdist, probe_delete,
+	    fi, fq);
+
+	qsort(fq->fq_sugg, fq->fq_nsugg, sizeof(struct suggestion),
+	    suggestion_compare);
+	return (fq->fq_nsugg);
+}
+
+/*
+ * Read the whole of path ("-" for stdin) into one NUL terminated buffer.
+ */
+char *
+read_file(char *path, size_t *lenp)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, size = 0, n;
+
+	fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open query file at : %s\n", path);
+		exit(1);
+	}
+
+	do {
+		if (size - len < 65536) {
+			size = size ? size * 2 : 1 << 20;
+			buf = realloc(buf, size + 1);
+			if (buf == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		n = fread(buf + len, 1, size - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	buf[len] = '\0';
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * MSD radix sort of q[0..n) on the bytes from depth onwards. Small
+ * partitions are finished off with an insertion sort.
+ */
+void
+radix_sort_queries(struct bulk_query **q, struct bulk_query **tmp, size_t n,
+    int depth)
+{
+	size_t count[256], pos[256], i, j;
+	struct bulk_query *t;
+	unsigned char c;
+
+	if (n < 32) {
+		for (i = 1; i < n; i++) {
+			t = q[i];
+			for (j = i; j > 0 && strcmp(q[j - 1]->bq_word + depth,
+			    t->bq_word + depth) > 0; j--) {
+				q[j] = q[j - 1];
+			}
+			q[j] = t;
+		}
+		return;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++) {
+		count[(unsigned char)q[i]->bq_word[depth]]++;
+	}
+	for (pos[0] = 0, i = 1; i < 256; i++) {
+		pos[i] = pos[i - 1] + count[i - 1];
+	}
+	for (i = 0; i < n; i++) {
+		c = q[i]->bq_word[depth];
+		tmp[pos[c]++] = q[i];
+	}
+	memcpy(q, tmp, n * sizeof(struct bulk_query *));
+
+	/* Bucket 0 holds the strings that end here; they are all equal */
+	for (i = count[0], c = 1; c != 0; i += count[c], c++) {
+		if (count[c] > 1) {
+			radix_sort_queries(q + i, tmp, count[c], depth + 1);
+		}
+	}
+}
+
+/*
+ * Answer every whitespace separated token in path against the dictionary.
+ * Rather than descending the tree once per token, the tokens are radix
+ * sorted and merged against the sorted word array in a single pass. The merge
+ * gallops over runs of dictionary words that no query falls into, so a
+ * small query file does not pay for a full dictionary walk either.
+ * Results are printed in input order.
+ */
+void
+bulk_search(char **words, uint32_t nwords, char *path)
+{
+	struct bulk_query *q = NULL, **sorted, **tmp;
+	size_t nq = 0, qsize = 0, len, i;
+	uint32_t lo, hi, mid, step;
+	struct timeval start, end;
+	char *buf, *tok;
+	int cmp;
+
+	buf = read_file(path, &len);
+
+	gettimeofday(&start, NULL);
+	for (tok = strtok(buf, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if (nq == qsize) {
+			qsize = qsize ? qsize * 2 : 4096;
+			q = realloc(q, qsize * sizeof(struct bulk_query));
+			if (q == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		q[nq].bq_word = tok;
+		q[nq].bq_found = 0;
+		nq++;
+	}
+
+	sorted = malloc((nq ? nq : 1) * sizeof(struct bulk_query *));
+	tmp = malloc((nq ? nq : 1) * sizeof(struct bulk_query *));
+	if (sorted == NULL || tmp == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < nq; i++) {
+		sorted[i] = &q[i];
+	}
+	radix_sort_queries(sorted, tmp, nq, 0);
+	free(tmp);
+
+	lo = 0;
+	for (i = 0; i < nq && lo < nwords; i++) {
+		/* Gallop to bracket the first dictionary word >= the query */
+		for (step = 1, hi = lo; hi < nwords &&
+		    strcmp(words[hi], sorted[i]->bq_word) < 0; step *= 2) {
+			lo = hi + 1;
+			hi = lo + step - 1;
+		}
+		if (hi > nwords) {
+			hi = nwords;
+		}
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			cmp = strcmp(words[mid], sorted[i]->bq_word);
+			if (cmp < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo < nwords && strcmp(words[lo], sorted[i]->bq_word) == 0) {
+			sorted[i]->bq_found = 1;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	for (i = 0; i < nq; i++) {
+		fputs(q[i].bq_word, stdout);
+		fputs(q[i].bq_found ? " found in tree\n" :
+		    " not found in tree\n", stdout);
+	}
+	fflush(stdout);
+
+	fprintf(stderr, "time in microseconds for %lu bulk lookups : %lu\n",
+	    nq, to_microsec(&end) - to_microsec(&start));
+
+	free(sorted);
+	free(q);
+	free(buf);
+}
+
 int
 query_word_from_user(char *temp)
 {
 	int i;
 	printf("Enter word: ");
-	fflush(stdin);
-	fgets(temp, MAX_WORD_SIZE, stdin);
+	fflush(stdout);
+	if (fgets(temp, MAX_WORD_SIZE, stdin) == NULL) {
+		/* EOF */
+		return (-1);
+	}
 	/* fgets() reads the newline into the buffer. Remove if present */
 	for (i = 0; i < strlen(temp); i++) {
 		if (temp[i] == '\n') {
 			temp[i] = '\0';
 		}
 	}
+	return (0);
+}
+
+void
+usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s [-f <max edit distance (1-%d)>] "
+	    "[-b <query file>] [-c]\n"
+	    "\t-f : suggest words within this distance of a missing word\n"
+	    "\t-b : check every word in the file (- for stdin) and exit\n"
+	    "\t-c : keep the dictionary front-coded instead of in a tree\n"
+	    "A query ending in '*' lists every word with that prefix\n",
+	    argv[0], MAX_FUZZY_DIST);
+	exit(1);
 }
 
 int
-main()
+main(int argc, char **argv)
 {
 	tree_handle_t th;
-	int ret;
+	fc_dict_t fc;
+	fuzzy_index_t fi;
+	struct fuzzy_query fq;
+	struct timeval start, end;
+	int ret, i, opt, len;
+	int maxdist = 0, compressed = 0;
+	char *bulk_file = NULL;
 	char temp[MAX_WORD_SIZE];
 
-	init_tree(&th);
-	populate_tree(&th);
+	while ((opt = getopt(argc, argv, "b:cf:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bulk_file = optarg;
+			break;
+		case 'c':
+			compressed = 1;
+			break;
+		case 'f':
+			maxdist = atoi(optarg);
+			if (maxdist < 1 || maxdist > MAX_FUZZY_DIST) {
+				usage(argc, argv);
+			}
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+
+	if (compressed && (maxdist || bulk_file)) {
+		fprintf(stderr, "-c cannot be combined with -f or -b\n");
+		usage(argc, argv);
+	}
+
+	if (compressed) {
+		gettimeofday(&start, NULL);
+		fc_build(&fc);
+		gettimeofday(&end, NULL);
+		fprintf(stderr, "front-coded dictionary : %u words, %lu bytes "
+		    "(%.1f bytes/word), built in %lu microseconds\n",
+		    fc.fc_nwords, fc_bytes(&fc),
+		    (double)fc_bytes(&fc) / (fc.fc_nwords ? fc.fc_nwords : 1),
+		    to_microsec(&end) - to_microsec(&start));
+	} else if (EMBEDDED && maxdist == 0 && bulk_file == NULL) {
+		/* Queries go straight to the compiled-in sorted index */
+	} else {
+		init_tree(&th);
+		populate_tree(&th);
+	}
+
+	if (bulk_file) {
+		bulk_search(get_sorted_words(&th), th.th_nwords, bulk_file);
+		return (0);
+	}
+
+	if (maxdist) {
+		gettimeofday(&start, NULL);
+		build_fuzzy_index(&th, &fi, maxdist);
+		gettimeofday(&end, NULL);
+		fprintf(stderr, "fuzzy index : %u words, %lu deletes, "
+		    "%lu bytes (%.1f bytes/word), built in %lu microseconds\n",
+		    fi.fi_nwords, fi.fi_nentries, fuzzy_index_bytes(&fi),
+		    (double)fuzzy_index_bytes(&fi) / (fi.fi_nwords ?
+		    fi.fi_nwords : 1),
+		    to_microsec(&end) - to_microsec(&start));
+	}
 
 	while(1) {
-		query_word_from_user(temp);
-		ret = search_word_in_tree(&th, temp);
+		if (query_word_from_user(temp) != 0) {
+			break;
+		}
+		len = strlen(temp);
+		if (len > 0 && temp[len - 1] == '*') {
+			temp[len - 1] = '\0';
+			if (compressed) {
+				fc_prefix_search(&fc, temp);
+			} else if (EMBEDDED && maxdist == 0) {
+				embedded_prefix_search(temp);
+			} else {
+				tree_prefix_search(&th, temp);
+			}
+			continue;
+		}
+		if (compressed) {
+			ret = fc_search(&fc, temp);
+		} else if (EMBEDDED && maxdist == 0) {
+			ret = embedded_search(temp);
+		} else {
+			ret = search_word_in_tree(&th, temp);
+		}
 		if (ret == 0) {
 			printf("%s found in tree\n", temp);
 		} else {
 			printf("%s not found in tree\n", temp);
+			if (maxdist == 0) {
+				continue;
+			}
+			gettimeofday(&start, NULL);
+			fuzzy_search(&fi, temp, &fq);
+			gettimeofday(&end, NULL);
+			for (i = 0; i < fq.fq_nsugg; i++) {
+				printf("  %s (distance %d)\n",
+				    fq.fq_sugg[i].word, fq.fq_sugg[i].dist);
+			}
+			if (fq.fq_nfound > fq.fq_nsugg) {
+				printf("  ... %d more results omitted\n",
+				    fq.fq_nfound - fq.fq_nsugg);
+			}
+			fflush(stdout);
+			fprintf(stderr, "time in microseconds for fuzzy "
+			    "lookup : %lu\n", to_microsec(&end) -
+			    to_microsec(&start));
 		}
 	}
 	return (0);
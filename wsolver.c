@@ -2,14 +2,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/time.h>
 
 #include "tree.h"
 
 #define ASSERT(cond) {if (!(cond)) (*((char *)0) = 0);}
 
+#ifndef WORD_DB
 #define WORD_DB "/usr/share/dict/words"
+#endif
 #define MAX_WORD_SIZE 80
 
+/*
+ * -DEMBEDDED_DB builds take the dictionary from words_db.h, generated by
+ * mkwordsdb, instead of reading WORD_DB at run time.
+ */
+#ifdef EMBEDDED_DB
+#include "words_db.h"
+#define EMBEDDED 1
+#else
+#define EMBEDDED 0
+#define EMBEDDED_NWORDS 0
+static const char embedded_text[] = "";
+static const uint32_t embedded_index[] = { 0 };
+#endif
+
 struct list {
 	char *word;
 	struct list *next;
@@ -22,14 +46,171 @@ struct word_node {
 
 typedef struct word_node wnode_t;
 
+/*
+ * Blocked Bloom filter sitting in front of the tree. Each word sets
+ * BLOOM_K bits inside a single 512-bit block (one cache line), so most
+ * misses are turned away after one line read instead of a full tree
+ * descent with a string compare at every level.
+ */
+#define BLOOM_BITS_PER_WORD 10
+#define BLOOM_K 6
+
+struct bloom_block {
+	uint64_t bb_bits[8];
+} __attribute__((aligned(64)));
+
+typedef struct bloom_filter {
+	struct bloom_block *bf_blocks;
+	uint32_t bf_nblocks;
+	uint64_t bf_probes;	/* exact lookups made */
+	uint64_t bf_rejects;	/* lookups answered by the filter alone */
+	uint64_t bf_false_pos;	/* passed the filter, but not in the tree */
+	uint64_t bf_hits;	/* found in the tree */
+} bloom_filter_t;
+
 typedef struct tree_handle {
 	RB_HEAD(word_tree, word_node) th_tree;
+	uint32_t th_nwords;
+	bloom_filter_t th_bloom;
 } tree_handle_t;
 
+/*
+ * Sharded on-disk index (-B to build, -S to use). Words are partitioned
+ * by length and by a hash of their signature (their letters in sorted
+ * order) into SHARD_BUCKETS files per length. A shard file is a
+ * shard_header, an array of sh_nrecords record offsets sorted by
+ * signature, and the records themselves, each "signature\0word\0". A
+ * query maps only the one shard its signature can be in, and at most
+ * SHARD_CACHE_SIZE shards stay mapped, least recently used first out.
+ */
+#define SHARD_MAGIC 0x57534831	/* "WSH1" */
+#define SHARD_BUCKETS 16
+#define SHARD_CACHE_SIZE 32
+
+struct shard_header {
+	uint32_t sh_magic;
+	uint32_t sh_nrecords;
+};
+
+struct shard_map {
+	int sm_len;		/* 0 if the slot is free */
+	int sm_bucket;
+	char *sm_base;
+	size_t sm_size;
+	uint64_t sm_last_use;
+};
+
+typedef struct shard_cache {
+	char *sc_dir;
+	struct shard_map sc_maps[SHARD_CACHE_SIZE];
+	uint64_t sc_clock;
+	uint64_t sc_hits;
+	uint64_t sc_misses;
+} shard_cache_t;
+
+/*
+ * Result cache for the query loop. Queries that are anagrams of each
+ * other have the same answer, so results are keyed on the query mode
+ * and the signature of the input. Eviction is GreedyDual-Size: an entry
+ * is worth rc_clock + (microseconds it took to compute) / (bytes it
+ * holds) as of its last use, the cheapest entry goes first and rc_clock
+ * rises to its worth, so entries that were slow to compute and small
+ * to keep outlive those that are quick to redo.
+ */
+#define CACHE_ENTRIES 256
+#define CACHE_MAX_BYTES (1 << 20)
+
+struct cache_entry {
+	char ce_key[MAX_WORD_SIZE + 1];	/* mode, then signature */
+	uint64_t ce_hash;
+	char *ce_words;			/* the output, one word per line */
+	size_t ce_len;
+	double ce_cost;			/* microseconds to compute */
+	double ce_worth;
+};
+
+typedef struct result_cache {
+	struct cache_entry *rc_entries;
+	int rc_size;
+	int rc_nentries;
+	size_t rc_bytes;
+	double rc_clock;
+	uint64_t rc_hits;
+	uint64_t rc_misses;
+	uint64_t rc_evictions;
+} result_cache_t;
+
+/* The words printed for the current query */
+struct result_buf {
+	char *rb_data;
+	size_t rb_len;
+	size_t rb_size;
+};
+
+/*
+ * Incremental solving (-i), for a UI where the rack changes by a letter
+ * at a time. Every dictionary word keeps its deficit, the number of its
+ * letters the rack lacks. For each letter c and count k, is_lists holds
+ * the words with at least k c's: adding the k-th c to the rack lowers
+ * exactly their deficits, and taking it away raises them again. Words at
+ * deficit 0 can be made from the rack and are kept in a set per length,
+ * so the anagrams of the rack are the set for its length. Each query is
+ * diffed against the previous one, and a letter added or removed costs
+ * one list walk, however long the rack has grown.
+ */
+#define INC_LIST(c, k)	((c) * MAX_WORD_SIZE + (k))
+
+typedef struct inc_state {
+	uint32_t is_nwords;
+	char **is_words;		/* in dictionary order */
+	uint32_t *is_list_start;	/* INC_LIST(c, k) -> start in is_lists */
+	uint32_t *is_lists;
+	uint8_t *is_deficit;
+	uint32_t *is_pos;		/* word -> its place in is_set[len] */
+	uint32_t *is_set[MAX_WORD_SIZE];
+	uint32_t is_nset[MAX_WORD_SIZE];
+	int is_have[UCHAR_MAX + 1];	/* the rack, as counts per letter */
+	uint64_t is_touched;		/* deficits updated */
+} inc_state_t;
+
+/*
+ * Log-linear latency histogram in microseconds, after HdrHistogram:
+ * values below HIST_SUB are counted exactly, and every power of two
+ * above that is split into HIST_SUB equal buckets, so any value is off
+ * by less than 1/HIST_SUB. Values of 2^HIST_MAX_EXP and more land in
+ * the last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+/* Exported buckets end at 2^HIST_EXPORT_EXP - 1 microseconds (~67s) */
+#define HIST_EXPORT_EXP 26
+
+typedef struct latency_hist {
+	const char *lh_op;
+	uint64_t lh_counts[HIST_BUCKETS];
+	uint64_t lh_count;
+	uint64_t lh_sum;
+	uint64_t lh_max;
+} latency_hist_t;
+
+/* Operations timed by the query loop */
+enum {
+	OP_QUERY,	/* every query */
+	OP_SEARCH,	/* queries answered by searching */
+	OP_CACHED,	/* queries answered from the result cache */
+	OP_COUNT
+};
+
+/* Query typed in to get the metrics page */
+#define STATS_COMMAND "!stats"
+
 /* Globals */
 char copy[MAX_WORD_SIZE];
 tree_handle_t th;
 struct list *printed_wlist_head = NULL;
+struct result_buf results;
 
 int
 str_compare(const void *query_key, const void *cur)
@@ -54,7 +235,7 @@ wnode_t *get_tree_node(char *str)
 {
 	wnode_t *w = ((wnode_t *) malloc(sizeof(wnode_t)));
 	if (w) {
-		w->word = malloc(strlen(str));
+		w->word = malloc(strlen(str) + 1);
 		if (w->word) {
 			strcpy(w->word, str);
 		} else {
@@ -68,10 +249,108 @@ wnode_t *get_tree_node(char *str)
 	return (w);
 }
 
+uint64_t
+hash_word(const char *str)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	/* FNV-1a followed by a murmur3 style finalizer to spread the bits */
+	for (; *str != '\0'; str++) {
+		h ^= (unsigned char)*str;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+/*
+ * The upper 32 bits of the hash pick the block, the lower 32 bits give
+ * the BLOOM_K bit positions within it by double hashing.
+ */
+struct bloom_block *
+bloom_block_of(bloom_filter_t *bf, uint64_t h)
+{
+	return (&bf->bf_blocks[((h >> 32) * bf->bf_nblocks) >> 32]);
+}
+
+void
+bloom_add(bloom_filter_t *bf, const char *str)
+{
+	uint64_t h = hash_word(str);
+	struct bloom_block *b = bloom_block_of(bf, h);
+	uint32_t h1 = h & 0xffff, h2 = ((h >> 16) & 0xffff) | 1;
+	int i, bit;
+
+	for (i = 0; i < BLOOM_K; i++) {
+		bit = (h1 + i * h2) & 511;
+		b->bb_bits[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+/* Returns 0 if str may be in the tree, ENOENT if it definitely is not */
+int
+bloom_check(bloom_filter_t *bf, const char *str)
+{
+	uint64_t h = hash_word(str);
+	struct bloom_block *b = bloom_block_of(bf, h);
+	uint32_t h1 = h & 0xffff, h2 = ((h >> 16) & 0xffff) | 1;
+	int i, bit;
+
+	for (i = 0; i < BLOOM_K; i++) {
+		bit = (h1 + i * h2) & 511;
+		if ((b->bb_bits[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+			return (ENOENT);
+		}
+	}
+	return (0);
+}
+
+void
+build_bloom_filter(tree_handle_t *handle)
+{
+	bloom_filter_t *bf = &handle->th_bloom;
+	wnode_t *node;
+	size_t bytes;
+
+	bf->bf_nblocks = ((uint64_t)handle->th_nwords * BLOOM_BITS_PER_WORD +
+	    511) / 512;
+	if (bf->bf_nblocks == 0) {
+		bf->bf_nblocks = 1;
+	}
+	bytes = bf->bf_nblocks * sizeof(struct bloom_block);
+	bf->bf_blocks = aligned_alloc(sizeof(struct bloom_block), bytes);
+	if (bf->bf_blocks == NULL) {
+		perror("aligned_alloc");
+		exit(1);
+	}
+	memset(bf->bf_blocks, 0, bytes);
+
+	RB_FOREACH(node, word_tree, &handle->th_tree) {
+		bloom_add(bf, node->word);
+	}
+}
+
+void
+print_bloom_stats(bloom_filter_t *bf)
+{
+	uint64_t misses = bf->bf_rejects + bf->bf_false_pos;
+
+	fprintf(stderr, "bloom filter : %lu bytes, %lu probes, %lu hits "
+	    "(%.2f%%), %lu rejected by filter, false positive rate %.4f%%\n",
+	    bf->bf_nblocks * sizeof(struct bloom_block), bf->bf_probes,
+	    bf->bf_hits, bf->bf_probes ?
+	    100.0 * bf->bf_hits / bf->bf_probes : 0.0, bf->bf_rejects,
+	    misses ? 100.0 * bf->bf_false_pos / misses : 0.0);
+}
+
 void
 init_tree(tree_handle_t *handle)
 {
 	RB_INIT(&handle->th_tree);
+	handle->th_nwords = 0;
+	memset(&handle->th_bloom, 0, sizeof(bloom_filter_t));
 }
 
 int
@@ -86,10 +365,12 @@ add_word_to_tree(tree_handle_t *handle, char *add_str)
 
 	if (RB_FIND(word_tree, &handle->th_tree, node) != NULL) {
 		/* Node already present */
+		free(node->word);
 		free(node);
 		ret = EEXIST;
 	} else {
 		RB_INSERT(word_tree, &handle->th_tree, (void *)node);
+		handle->th_nwords++;
 	}
 
 	return (ret);
@@ -101,20 +382,79 @@ search_word_in_tree(tree_handle_t *handle, char *search_str)
 	wnode_t temp, *node;
 	int ret;
 
+	handle->th_bloom.bf_probes++;
+	if (bloom_check(&handle->th_bloom, search_str) != 0) {
+		handle->th_bloom.bf_rejects++;
+		return (ENOENT);
+	}
+
 	memset((void *)&temp, 0, sizeof(wnode_t));
 	temp.word = search_str;
 
 	if ((node = RB_FIND(word_tree, &handle->th_tree, &temp)) != NULL) {
 		/* Found */
+		handle->th_bloom.bf_hits++;
 		ret = 0;
 	} else {
 		/* Not Found */
+		handle->th_bloom.bf_false_pos++;
 		ret = ENOENT;
 	}
 
 	return (ret);
 }
 
+/* Open the word list, the compiled-in copy in EMBEDDED builds */
+FILE *
+open_word_db(void)
+{
+	if (EMBEDDED) {
+		return (fmemopen((void *)embedded_text,
+		    sizeof(embedded_text) - 1, "r"));
+	}
+	return (fopen(WORD_DB, "r"));
+}
+
+/*
+ * Compare str with the newline terminated word at off in embedded_text,
+ * like strcmp().
+ */
+int
+embedded_compare(const char *str, uint32_t off)
+{
+	const unsigned char *x = (const unsigned char *)str;
+	const unsigned char *y = (const unsigned char *)embedded_text + off;
+	int cy;
+
+	for (;; x++, y++) {
+		cy = (*y == '\n') ? 0 : *y;
+		if (*x != cy || *x == 0) {
+			return (*x - cy);
+		}
+	}
+}
+
+/* Binary search the compiled-in sorted index */
+int
+embedded_search(char *search_str)
+{
+	uint32_t lo = 0, hi = EMBEDDED_NWORDS, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = embedded_compare(search_str, embedded_index[mid]);
+		if (cmp == 0) {
+			return (0);
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (ENOENT);
+}
+
 int
 populate_tree(tree_handle_t *tree)
 {
@@ -122,7 +462,7 @@ populate_tree(tree_handle_t *tree)
 	FILE *fp;
 	char temp[MAX_WORD_SIZE];
 
-	fp = fopen(WORD_DB, "r");
+	fp = open_word_db();
 	if (fp == NULL) {
 		fprintf(stderr, "Could not open word database at : %s\n",
 		    WORD_DB);
@@ -136,6 +476,7 @@ populate_tree(tree_handle_t *tree)
 	}
 
 	fclose(fp);
+	build_bloom_filter(tree);
 	return (0);
 }
 
@@ -144,14 +485,18 @@ query_word_from_user(char *temp)
 {
 	int i;
 	printf("Enter jumbled word: ");
-	fflush(stdin);
-	fgets(temp, MAX_WORD_SIZE, stdin);
+	fflush(stdout);
+	if (fgets(temp, MAX_WORD_SIZE, stdin) == NULL) {
+		/* EOF */
+		return (-1);
+	}
 	/* fgets() reads the newline into the buffer. Remove if present */
 	for (i = 0; i < strlen(temp); i++) {
 		if (temp[i] == '\n') {
 			temp[i] = '\0';
 		}
 	}
+	return (0);
 }
 
 void __attribute__((always_inline))
@@ -202,7 +547,7 @@ get_wlist_node(char *str)
 {
 	struct list *temp = malloc(sizeof(struct list));
 	if (temp) {
-		temp->word = malloc(strlen(str));
+		temp->word = malloc(strlen(str) + 1);
 		if (temp->word) {
 			strcpy(temp->word, str);
 			temp->next = NULL;
@@ -214,6 +559,7 @@ get_wlist_node(char *str)
 		perror("malloc");
 		exit(1);
 	}
+	return (temp);
 }
 
 int
@@ -240,15 +586,49 @@ search_printed_words(char *str)
 	return (0);
 }
 
+/* Forget the words printed for the previous query */
+void
+free_printed_words(void)
+{
+	struct list *temp;
+
+	while ((temp = printed_wlist_head) != NULL) {
+		printed_wlist_head = temp->next;
+		free(temp->word);
+		free(temp);
+	}
+}
+
+/* Print a word of the answer, keeping a copy for the result cache */
+void
+emit_word(char *str)
+{
+	size_t len = strlen(str);
+
+	printf("%s\n", str);
+	if (results.rb_len + len + 1 > results.rb_size) {
+		results.rb_size = (results.rb_len + len + 1) * 2;
+		results.rb_data = realloc(results.rb_data, results.rb_size);
+		if (results.rb_data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(results.rb_data + results.rb_len, str, len);
+	results.rb_len += len;
+	results.rb_data[results.rb_len++] = '\n';
+}
+
 void
 get_all_permutations(char *p, int len)
 {
 	int i, t;
 
 	if (len == 1) {
-		if (search_word_in_tree(&th, copy) == 0) {
+		if ((EMBEDDED ? embedded_search(copy) :
+		    search_word_in_tree(&th, copy)) == 0) {
 			if (search_printed_words(copy) == 0) {
-				printf("%s\n", copy);
+				emit_word(copy);
 			}
 		}
 		return;
@@ -277,20 +657,917 @@ get_all_permutations(char *p, int len)
 	}
 }
 
+/* Put the signature (letters in sorted order) of word into sig */
+void
+get_signature(char *word, char *sig)
+{
+	int i, j, len = strlen(word);
+	char t;
+
+	strcpy(sig, word);
+	for (i = 1; i < len; i++) {
+		t = sig[i];
+		for (j = i; j > 0 && (unsigned char)sig[j - 1] >
+		    (unsigned char)t; j--) {
+			sig[j] = sig[j - 1];
+		}
+		sig[j] = t;
+	}
+}
+
 int
-main()
+shard_bucket(char *sig)
 {
-	int ret;
+	return (hash_word(sig) % SHARD_BUCKETS);
+}
+
+void
+shard_path(char *dir, int len, int bucket, char *path, size_t size)
+{
+	snprintf(path, size, "%s/L%02d-%02d.shard", dir, len, bucket);
+}
+
+/*
+ * Make sure dir holds shards before taking queries, rather than answer
+ * every query with nothing.
+ */
+void
+check_shard_dir(char *dir)
+{
+	struct dirent *de;
+	size_t len;
+	int nshards = 0;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL) {
+		perror(dir);
+		exit(1);
+	}
+	while ((de = readdir(dp)) != NULL) {
+		len = strlen(de->d_name);
+		if (len > 6 && strcmp(de->d_name + len - 6, ".shard") == 0) {
+			nshards++;
+		}
+	}
+	closedir(dp);
+	if (nshards == 0) {
+		fprintf(stderr, "No shards in %s, build them with -B\n", dir);
+		exit(1);
+	}
+}
+
+/* A "signature\0word\0" record being collected for a shard */
+struct shard_rec {
+	char *sr_rec;
+	int sr_size;
+};
+
+int
+shard_rec_compare(const void *a, const void *b)
+{
+	const struct shard_rec *x = a, *y = b;
+	int cmp = strcmp(x->sr_rec, y->sr_rec);
+
+	if (cmp == 0) {
+		cmp = strcmp(x->sr_rec + strlen(x->sr_rec) + 1,
+		    y->sr_rec + strlen(y->sr_rec) + 1);
+	}
+	return (cmp);
+}
+
+/*
+ * Split WORD_DB into shard files under dir. Each shard is sorted in
+ * memory and written out in one go.
+ */
+void
+build_shards(char *dir)
+{
+	struct shard_rec *recs[MAX_WORD_SIZE][SHARD_BUCKETS];
+	size_t nrecs[MAX_WORD_SIZE][SHARD_BUCKETS];
+	size_t sizes[MAX_WORD_SIZE][SHARD_BUCKETS];
+	struct shard_header sh;
+	struct shard_rec *r;
+	char temp[MAX_WORD_SIZE], sig[MAX_WORD_SIZE];
+	char path[PATH_MAX];
+	uint32_t off;
+	size_t i, j;
+	int len, b, wlen;
+	FILE *fp;
+
+	memset(recs, 0, sizeof(recs));
+	memset(nrecs, 0, sizeof(nrecs));
+	memset(sizes, 0, sizeof(sizes));
+
+	fp = open_word_db();
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open word database at : %s\n",
+		    WORD_DB);
+		exit(1);
+	}
+	while(fscanf(fp, "%s", temp) != EOF) {
+		len = strlen(temp);
+		get_signature(temp, sig);
+		b = shard_bucket(sig);
+		if (nrecs[len][b] == sizes[len][b]) {
+			sizes[len][b] = sizes[len][b] ? sizes[len][b] * 2 : 64;
+			recs[len][b] = realloc(recs[len][b],
+			    sizes[len][b] * sizeof(struct shard_rec));
+			if (recs[len][b] == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		r = &recs[len][b][nrecs[len][b]++];
+		r->sr_size = 2 * (len + 1);
+		if ((r->sr_rec = malloc(r->sr_size)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(r->sr_rec, sig, len + 1);
+		memcpy(r->sr_rec + len + 1, temp, len + 1);
+	}
+	fclose(fp);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror(dir);
+		exit(1);
+	}
+	for (len = 1; len < MAX_WORD_SIZE; len++) {
+		for (b = 0; b < SHARD_BUCKETS; b++) {
+			if (nrecs[len][b] == 0) {
+				continue;
+			}
+			qsort(recs[len][b], nrecs[len][b],
+			    sizeof(struct shard_rec), shard_rec_compare);
+			/* Duplicate words sort next to each other */
+			for (i = 1, j = 1; i < nrecs[len][b]; i++) {
+				r = &recs[len][b][i];
+				if (shard_rec_compare(r,
+				    &recs[len][b][j - 1]) == 0) {
+					fprintf(stderr, "%s already in shard\n",
+					    r->sr_rec + len + 1);
+					free(r->sr_rec);
+					continue;
+				}
+				recs[len][b][j++] = *r;
+			}
+			nrecs[len][b] = j;
+			shard_path(dir, len, b, path, sizeof(path));
+			if ((fp = fopen(path, "w")) == NULL) {
+				perror(path);
+				exit(1);
+			}
+			sh.sh_magic = SHARD_MAGIC;
+			sh.sh_nrecords = nrecs[len][b];
+			fwrite(&sh, sizeof(sh), 1, fp);
+			off = sizeof(sh) + nrecs[len][b] * sizeof(uint32_t);
+			for (i = 0; i < nrecs[len][b]; i++) {
+				fwrite(&off, sizeof(off), 1, fp);
+				off += recs[len][b][i].sr_size;
+			}
+			for (i = 0; i < nrecs[len][b]; i++) {
+				wlen = recs[len][b][i].sr_size;
+				fwrite(recs[len][b][i].sr_rec, 1, wlen, fp);
+				free(recs[len][b][i].sr_rec);
+			}
+			if (fclose(fp) != 0) {
+				perror(path);
+				exit(1);
+			}
+			free(recs[len][b]);
+		}
+	}
+}
+
+/*
+ * Return the mapping of shard (len, bucket), mapping it if needed.
+ * Returns NULL if there is no such shard, i.e. no word can match.
+ */
+struct shard_map *
+get_shard(shard_cache_t *sc, int len, int bucket)
+{
+	struct shard_map *sm, *victim = NULL;
+	struct shard_header *sh;
+	struct stat st;
+	char path[PATH_MAX];
+	int i, fd;
+
+	sc->sc_clock++;
+	for (i = 0; i < SHARD_CACHE_SIZE; i++) {
+		sm = &sc->sc_maps[i];
+		if (sm->sm_len == len && sm->sm_bucket == bucket) {
+			sm->sm_last_use = sc->sc_clock;
+			sc->sc_hits++;
+			return (sm);
+		}
+		if (victim == NULL || sm->sm_len == 0 ||
+		    (victim->sm_len != 0 &&
+		    sm->sm_last_use < victim->sm_last_use)) {
+			victim = sm;
+		}
+	}
+	sc->sc_misses++;
+
+	shard_path(sc->sc_dir, len, bucket, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return (NULL);
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size <
+	    sizeof(struct shard_header)) {
+		close(fd);
+		return (NULL);
+	}
+
+	if (victim->sm_len != 0) {
+		munmap(victim->sm_base, victim->sm_size);
+		victim->sm_len = 0;
+	}
+	victim->sm_base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (victim->sm_base == MAP_FAILED) {
+		perror("mmap");
+		return (NULL);
+	}
+	sh = (struct shard_header *)victim->sm_base;
+	if (sh->sh_magic != SHARD_MAGIC) {
+		fprintf(stderr, "%s is not a shard file\n", path);
+		munmap(victim->sm_base, st.st_size);
+		return (NULL);
+	}
+	victim->sm_size = st.st_size;
+	victim->sm_len = len;
+	victim->sm_bucket = bucket;
+	victim->sm_last_use = sc->sc_clock;
+	return (victim);
+}
+
+/* Print every word that uses all the letters of str, from the shards */
+void
+search_shards(shard_cache_t *sc, char *str)
+{
+	struct shard_map *sm;
+	struct shard_header *sh;
+	uint32_t *offs, lo, hi, mid;
+	char sig[MAX_WORD_SIZE], *rec;
+	int len = strlen(str);
+
+	if (len == 0) {
+		return;
+	}
+	get_signature(str, sig);
+	if ((sm = get_shard(sc, len, shard_bucket(sig))) == NULL) {
+		return;
+	}
+	sh = (struct shard_header *)sm->sm_base;
+	offs = (uint32_t *)(sh + 1);
+
+	/* First record whose signature is >= sig */
+	lo = 0;
+	hi = sh->sh_nrecords;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(sm->sm_base + offs[mid], sig) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo < sh->sh_nrecords; lo++) {
+		rec = sm->sm_base + offs[lo];
+		if (strcmp(rec, sig) != 0) {
+			break;
+		}
+		emit_word(rec + len + 1);
+	}
+}
+
+/* Index the dictionary for -i, starting from an empty rack */
+void
+init_inc_state(inc_state_t *is)
+{
+	uint32_t *fill, nlen[MAX_WORD_SIZE], w, i;
+	int counts[UCHAR_MAX + 1];
+	unsigned char *p;
+	wnode_t *node;
+	int c, k, len;
+
+	memset(is, 0, sizeof(inc_state_t));
+	is->is_nwords = EMBEDDED ? EMBEDDED_NWORDS : th.th_nwords;
+	is->is_words = malloc((is->is_nwords + 1) * sizeof(char *));
+	if (is->is_words == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	if (EMBEDDED) {
+		for (w = 0; w < is->is_nwords; w++) {
+			p = (unsigned char *)embedded_text + embedded_index[w];
+			for (len = 0; p[len] != '\n'; len++)
+				;
+			if ((is->is_words[w] = strndup((char *)p, len)) ==
+			    NULL) {
+				perror("strndup");
+				exit(1);
+			}
+		}
+	} else {
+		w = 0;
+		RB_FOREACH(node, word_tree, &th.th_tree) {
+			is->is_words[w++] = node->word;
+		}
+	}
+
+	/* Count the list and set sizes, then fill them in */
+	is->is_list_start = calloc(INC_LIST(UCHAR_MAX + 1, 0) + 1,
+	    sizeof(uint32_t));
+	fill = calloc(INC_LIST(UCHAR_MAX + 1, 0), sizeof(uint32_t));
+	is->is_deficit = malloc(is->is_nwords + 1);
+	is->is_pos = malloc((is->is_nwords + 1) * sizeof(uint32_t));
+	if (is->is_list_start == NULL || fill == NULL ||
+	    is->is_deficit == NULL || is->is_pos == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(nlen, 0, sizeof(nlen));
+	memset(counts, 0, sizeof(counts));
+	for (w = 0; w < is->is_nwords; w++) {
+		len = strlen(is->is_words[w]);
+		is->is_deficit[w] = len;
+		nlen[len]++;
+		for (p = (unsigned char *)is->is_words[w]; *p; p++) {
+			is->is_list_start[INC_LIST(*p, ++counts[*p]) + 1]++;
+		}
+		for (p = (unsigned char *)is->is_words[w]; *p; p++) {
+			counts[*p] = 0;
+		}
+	}
+	for (i = 0; i < INC_LIST(UCHAR_MAX + 1, 0); i++) {
+		is->is_list_start[i + 1] += is->is_list_start[i];
+		fill[i] = is->is_list_start[i];
+	}
+	is->is_lists = malloc((is->is_list_start[INC_LIST(UCHAR_MAX + 1, 0)]
+	    + 1) * sizeof(uint32_t));
+	if (is->is_lists == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (w = 0; w < is->is_nwords; w++) {
+		for (p = (unsigned char *)is->is_words[w]; *p; p++) {
+			c = *p;
+			k = ++counts[c];
+			is->is_lists[fill[INC_LIST(c, k)]++] = w;
+		}
+		for (p = (unsigned char *)is->is_words[w]; *p; p++) {
+			counts[*p] = 0;
+		}
+	}
+	free(fill);
+
+	for (len = 0; len < MAX_WORD_SIZE; len++) {
+		is->is_set[len] = malloc((nlen[len] + 1) * sizeof(uint32_t));
+		if (is->is_set[len] == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+}
+
+void
+inc_add_letter(inc_state_t *is, int c)
+{
+	uint32_t i, w, end;
+	int len;
+
+	i = is->is_list_start[INC_LIST(c, ++is->is_have[c])];
+	end = is->is_list_start[INC_LIST(c, is->is_have[c]) + 1];
+	is->is_touched += end - i;
+	for (; i < end; i++) {
+		w = is->is_lists[i];
+		if (--is->is_deficit[w] == 0) {
+			len = strlen(is->is_words[w]);
+			is->is_pos[w] = is->is_nset[len];
+			is->is_set[len][is->is_nset[len]++] = w;
+		}
+	}
+}
+
+void
+inc_remove_letter(inc_state_t *is, int c)
+{
+	uint32_t i, w, end, last;
+	int len;
+
+	i = is->is_list_start[INC_LIST(c, is->is_have[c])];
+	end = is->is_list_start[INC_LIST(c, is->is_have[c]) + 1];
+	is->is_have[c]--;
+	is->is_touched += end - i;
+	for (; i < end; i++) {
+		w = is->is_lists[i];
+		if (is->is_deficit[w]++ == 0) {
+			/* Move the set's last word into w's place */
+			len = strlen(is->is_words[w]);
+			last = is->is_set[len][--is->is_nset[len]];
+			is->is_set[len][is->is_pos[w]] = last;
+			is->is_pos[last] = is->is_pos[w];
+		}
+	}
+}
+
+int
+word_index_compare(const void *a, const void *b)
+{
+	uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Bring the rack to the letters of str by adding and removing only the
+ * letters that differ from the last query, then print its anagrams.
+ */
+void
+inc_solve(inc_state_t *is, char *str)
+{
+	int want[UCHAR_MAX + 1];
+	uint32_t *set, i;
+	unsigned char *p;
+	int c, len;
+
+	memset(want, 0, sizeof(want));
+	for (p = (unsigned char *)str; *p; p++) {
+		want[*p]++;
+	}
+	for (p = (unsigned char *)str; *p; p++) {
+		while (is->is_have[*p] < want[*p]) {
+			inc_add_letter(is, *p);
+		}
+	}
+	for (c = 0; c <= UCHAR_MAX; c++) {
+		while (is->is_have[c] > want[c]) {
+			inc_remove_letter(is, c);
+		}
+	}
+
+	len = p - (unsigned char *)str;
+	set = is->is_set[len];
+	qsort(set, is->is_nset[len], sizeof(uint32_t), word_index_compare);
+	for (i = 0; i < is->is_nset[len]; i++) {
+		is->is_pos[set[i]] = i;
+		emit_word(is->is_words[set[i]]);
+	}
+}
+
+void
+init_result_cache(result_cache_t *rc, int size)
+{
+	memset(rc, 0, sizeof(result_cache_t));
+	rc->rc_size = size;
+	if (size == 0) {
+		return;
+	}
+	rc->rc_entries = calloc(size, sizeof(struct cache_entry));
+	if (rc->rc_entries == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+}
+
+/* Fill key with the cache key of a query for str in the given mode */
+void
+get_cache_key(char mode, char *str, char *key)
+{
+	key[0] = mode;
+	get_signature(str, key + 1);
+}
+
+struct cache_entry *
+cache_lookup(result_cache_t *rc, char *key)
+{
+	struct cache_entry *ce;
+	uint64_t h;
+	int i;
+
+	/* With no cache there is nothing to miss */
+	if (rc->rc_size == 0) {
+		return (NULL);
+	}
+	h = hash_word(key);
+	for (i = 0; i < rc->rc_nentries; i++) {
+		ce = &rc->rc_entries[i];
+		if (ce->ce_hash == h && strcmp(ce->ce_key, key) == 0) {
+			ce->ce_worth = rc->rc_clock + ce->ce_cost /
+			    (ce->ce_len + sizeof(struct cache_entry));
+			rc->rc_hits++;
+			return (ce);
+		}
+	}
+	rc->rc_misses++;
+	return (NULL);
+}
+
+void
+cache_evict(result_cache_t *rc)
+{
+	struct cache_entry *ce, *victim = &rc->rc_entries[0];
+	int i;
+
+	for (i = 1; i < rc->rc_nentries; i++) {
+		ce = &rc->rc_entries[i];
+		if (ce->ce_worth < victim->ce_worth) {
+			victim = ce;
+		}
+	}
+	rc->rc_clock = victim->ce_worth;
+	rc->rc_bytes -= victim->ce_len;
+	free(victim->ce_words);
+	*victim = rc->rc_entries[--rc->rc_nentries];
+	rc->rc_evictions++;
+}
+
+/* Remember words (len bytes) as the answer for key, which took cost us */
+void
+cache_insert(result_cache_t *rc, char *key, char *words, size_t len,
+    double cost)
+{
+	struct cache_entry *ce;
+
+	if (rc->rc_size == 0 || len > CACHE_MAX_BYTES) {
+		return;
+	}
+	while (rc->rc_nentries == rc->rc_size ||
+	    rc->rc_bytes + len > CACHE_MAX_BYTES) {
+		cache_evict(rc);
+	}
+	ce = &rc->rc_entries[rc->rc_nentries++];
+	strcpy(ce->ce_key, key);
+	ce->ce_hash = hash_word(key);
+	if ((ce->ce_words = malloc(len + 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(ce->ce_words, words, len);
+	ce->ce_len = len;
+	ce->ce_cost = cost;
+	ce->ce_worth = rc->rc_clock + cost / (len + sizeof(struct cache_entry));
+	rc->rc_bytes += len;
+}
+
+void
+print_cache_stats(result_cache_t *rc)
+{
+	uint64_t lookups = rc->rc_hits + rc->rc_misses;
+
+	if (rc->rc_size == 0) {
+		fprintf(stderr, "result cache : no cache\n");
+		return;
+	}
+	fprintf(stderr, "result cache : %d entries, %lu bytes, %lu hits "
+	    "(%.2f%%), %lu misses, %lu evictions\n", rc->rc_nentries,
+	    rc->rc_bytes, rc->rc_hits, lookups ?
+	    100.0 * rc->rc_hits / lookups : 0.0, rc->rc_misses,
+	    rc->rc_evictions);
+}
+
+uint64_t
+to_microsec(struct timeval *tv)
+{
+	return (tv->tv_sec * 1000000L + tv->tv_usec);
+}
+
+void
+usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s [-s] [-C <cache entries>] "
+	    "[-B <shard dir> | -S <shard dir> | -i]\n"
+	    "\t-s : print lookup and cache statistics after each query\n"
+	    "\t-C : remember the answers to this many queries (default %d, "
+	    "0 to disable)\n"
+	    "\t-B : split the dictionary into a sharded index and exit\n"
+	    "\t-S : answer queries from a sharded index, loading only the "
+	    "shards needed\n"
+	    "\t-i : solve each query by updating the previous one's "
+	    "answer with the\n\t     letters added and removed\n"
+	    "Entering %s prints metrics in the Prometheus text format\n",
+	    argv[0], CACHE_ENTRIES, STATS_COMMAND);
+	exit(1);
+}
+
+void
+init_hist(latency_hist_t *lh, const char *op)
+{
+	memset(lh, 0, sizeof(latency_hist_t));
+	lh->lh_op = op;
+}
+
+int
+hist_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB) {
+		return (v);
+	}
+	if (v >= 1ULL << HIST_MAX_EXP) {
+		return (HIST_BUCKETS - 1);
+	}
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) * HIST_SUB +
+	    ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+/* Largest value counted in bucket b */
+uint64_t
+hist_bucket_max(int b)
+{
+	int e;
+
+	if (b < HIST_SUB) {
+		return (b);
+	}
+	e = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return (((uint64_t)(HIST_SUB + b % HIST_SUB + 1) <<
+	    (e - HIST_SUB_BITS)) - 1);
+}
+
+void
+hist_record(latency_hist_t *lh, uint64_t v)
+{
+	lh->lh_counts[hist_bucket(v)]++;
+	lh->lh_count++;
+	lh->lh_sum += v;
+	if (v > lh->lh_max) {
+		lh->lh_max = v;
+	}
+}
+
+/* Value at quantile q (0 < q <= 1), to within a bucket */
+uint64_t
+hist_quantile(latency_hist_t *lh, double q)
+{
+	uint64_t rank, seen = 0;
+	int b;
+
+	if (lh->lh_count == 0) {
+		return (0);
+	}
+	rank = q * lh->lh_count + 0.5;
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += lh->lh_counts[b];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return (hist_bucket_max(b) < lh->lh_max ? hist_bucket_max(b) :
+	    lh->lh_max);
+}
+
+/* Resident set size in bytes, 0 if unknown */
+uint64_t
+get_rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL) {
+		return (0);
+	}
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(fp);
+	return ((uint64_t)resident * sysconf(_SC_PAGESIZE));
+}
+
+void
+print_cache_metrics(FILE *fp, result_cache_t *rc)
+{
+	fprintf(fp, "# HELP wsolver_cache_lookups_total Result cache "
+	    "lookups.\n"
+	    "# TYPE wsolver_cache_lookups_total counter\n"
+	    "wsolver_cache_lookups_total{result=\"hit\"} %lu\n"
+	    "wsolver_cache_lookups_total{result=\"miss\"} %lu\n",
+	    rc->rc_hits, rc->rc_misses);
+	fprintf(fp, "# HELP wsolver_cache_hit_ratio Share of lookups "
+	    "answered by the result cache.\n"
+	    "# TYPE wsolver_cache_hit_ratio gauge\n"
+	    "wsolver_cache_hit_ratio %.4f\n", rc->rc_hits + rc->rc_misses ?
+	    (double)rc->rc_hits / (rc->rc_hits + rc->rc_misses) : 0.0);
+	fprintf(fp, "# HELP wsolver_cache_evictions_total Result cache "
+	    "evictions.\n"
+	    "# TYPE wsolver_cache_evictions_total counter\n"
+	    "wsolver_cache_evictions_total %lu\n", rc->rc_evictions);
+	fprintf(fp, "# HELP wsolver_cache_bytes Bytes of cached answers.\n"
+	    "# TYPE wsolver_cache_bytes gauge\n"
+	    "wsolver_cache_bytes %lu\n", rc->rc_bytes);
+}
+
+/*
+ * Print the metrics in the Prometheus text format. The histograms are
+ * exported with the same bucket per power of two on every scrape, so
+ * they can be aggregated; the quantiles are worked out from the full
+ * resolution histograms.
+ */
+void
+print_metrics(FILE *fp, latency_hist_t *hists, result_cache_t *rc,
+    uint64_t uptime, uint64_t nwords)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	latency_hist_t *lh;
+	uint64_t cum, le;
+	size_t i;
+	int op, b;
+
+	fprintf(fp, "# HELP wsolver_query_latency_microseconds Time taken "
+	    "to answer a query.\n"
+	    "# TYPE wsolver_query_latency_microseconds histogram\n");
+	for (op = 0; op < OP_COUNT; op++) {
+		lh = &hists[op];
+		for (cum = 0, b = 0, i = 0; i <= HIST_EXPORT_EXP; i++) {
+			le = (1ULL << i) - 1;
+			for (; b < HIST_BUCKETS && hist_bucket_max(b) <= le;
+			    b++) {
+				cum += lh->lh_counts[b];
+			}
+			fprintf(fp, "wsolver_query_latency_microseconds_bucket"
+			    "{op=\"%s\",le=\"%lu\"} %lu\n", lh->lh_op, le,
+			    cum);
+		}
+		fprintf(fp, "wsolver_query_latency_microseconds_bucket"
+		    "{op=\"%s\",le=\"+Inf\"} %lu\n", lh->lh_op, lh->lh_count);
+		fprintf(fp, "wsolver_query_latency_microseconds_sum"
+		    "{op=\"%s\"} %lu\n", lh->lh_op, lh->lh_sum);
+		fprintf(fp, "wsolver_query_latency_microseconds_count"
+		    "{op=\"%s\"} %lu\n", lh->lh_op, lh->lh_count);
+	}
+
+	fprintf(fp, "# HELP wsolver_query_latency_quantile_microseconds "
+	    "Query latency quantiles since start.\n"
+	    "# TYPE wsolver_query_latency_quantile_microseconds gauge\n");
+	for (op = 0; op < OP_COUNT; op++) {
+		for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]);
+		    i++) {
+			fprintf(fp, "wsolver_query_latency_quantile_"
+			    "microseconds{op=\"%s\",quantile=\"%g\"} %lu\n",
+			    hists[op].lh_op, quantiles[i],
+			    hist_quantile(&hists[op], quantiles[i]));
+		}
+	}
+
+	/* A counter rather than a rate, so the scraper picks the window */
+	fprintf(fp, "# HELP wsolver_queries_total Queries answered.\n"
+	    "# TYPE wsolver_queries_total counter\n"
+	    "wsolver_queries_total %lu\n", hists[OP_QUERY].lh_count);
+	fprintf(fp, "# HELP wsolver_uptime_seconds Time since start.\n"
+	    "# TYPE wsolver_uptime_seconds gauge\n"
+	    "wsolver_uptime_seconds %.3f\n", uptime / 1e6);
+
+	if (rc->rc_size == 0) {
+		fprintf(fp, "# no result cache\n");
+	} else {
+		print_cache_metrics(fp, rc);
+	}
+
+	if (nwords) {
+		fprintf(fp, "# HELP wsolver_dictionary_words Words in the "
+		    "dictionary.\n"
+		    "# TYPE wsolver_dictionary_words gauge\n"
+		    "wsolver_dictionary_words %lu\n", nwords);
+	}
+	fprintf(fp, "# HELP wsolver_resident_memory_bytes Resident set "
+	    "size.\n"
+	    "# TYPE wsolver_resident_memory_bytes gauge\n"
+	    "wsolver_resident_memory_bytes %lu\n", get_rss());
+	fflush(fp);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret, opt;
+	int print_stats = 0, cache_size = CACHE_ENTRIES, incremental = 0;
+	char *build_dir = NULL;
+	shard_cache_t sc;
+	inc_state_t is;
+	result_cache_t rc;
+	struct cache_entry *ce;
+	struct timeval start, end, boot;
+	latency_hist_t hists[OP_COUNT];
+	uint64_t elapsed;
+	char key[MAX_WORD_SIZE + 1];
 	char temp[MAX_WORD_SIZE];
 
-	init_tree(&th);
-	populate_tree(&th);
+	memset(&sc, 0, sizeof(sc));
+	while ((opt = getopt(argc, argv, "B:C:isS:")) != -1) {
+		switch (opt) {
+		case 'B':
+			build_dir = optarg;
+			break;
+		case 'C':
+			cache_size = atoi(optarg);
+			if (cache_size < 0) {
+				usage(argc, argv);
+			}
+			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 's':
+			print_stats = 1;
+			break;
+		case 'S':
+			sc.sc_dir = optarg;
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+
+	if (build_dir) {
+		build_shards(build_dir);
+		return (0);
+	}
+	if (incremental) {
+		if (sc.sc_dir) {
+			usage(argc, argv);
+		}
+		/* The answer is a walk of a small set; nothing to cache */
+		cache_size = 0;
+	}
+	if (sc.sc_dir) {
+		check_shard_dir(sc.sc_dir);
+	}
+
+	/* EMBEDDED builds look words up in the compiled-in index */
+	if (sc.sc_dir == NULL && !EMBEDDED) {
+		init_tree(&th);
+		populate_tree(&th);
+	}
+	if (incremental) {
+		init_inc_state(&is);
+	}
+	init_result_cache(&rc, cache_size);
+	init_hist(&hists[OP_QUERY], "query");
+	init_hist(&hists[OP_SEARCH], "search");
+	init_hist(&hists[OP_CACHED], "cached");
+	gettimeofday(&boot, NULL);
 
 	while(1) {
-		query_word_from_user(temp);
-		/* Using strcpy since the input is sanitized via fgets */
-		strcpy(copy, temp);
-		get_all_permutations(&copy[0], strlen(copy));
+		if (query_word_from_user(temp) != 0) {
+			break;
+		}
+		if (strcmp(temp, STATS_COMMAND) == 0) {
+			/* Start the page on a line of its own, after the prompt */
+			printf("\n");
+			gettimeofday(&end, NULL);
+			print_metrics(stdout, hists, &rc, to_microsec(&end) -
+			    to_microsec(&boot), EMBEDDED ? EMBEDDED_NWORDS :
+			    th.th_nwords);
+			continue;
+		}
+		gettimeofday(&start, NULL);
+		get_cache_key(sc.sc_dir ? 's' : 'p', temp, key);
+		if ((ce = cache_lookup(&rc, key)) != NULL) {
+			fwrite(ce->ce_words, 1, ce->ce_len, stdout);
+		} else {
+			results.rb_len = 0;
+			if (incremental) {
+				inc_solve(&is, temp);
+			} else if (sc.sc_dir) {
+				search_shards(&sc, temp);
+			} else {
+				/*
+				 * Using strcpy since the input is sanitized
+				 * via fgets
+				 */
+				strcpy(copy, temp);
+				get_all_permutations(&copy[0], strlen(copy));
+				free_printed_words();
+			}
+			gettimeofday(&end, NULL);
+			cache_insert(&rc, key, results.rb_data, results.rb_len,
+			    to_microsec(&end) - to_microsec(&start) + 1);
+		}
+		gettimeofday(&end, NULL);
+		elapsed = to_microsec(&end) - to_microsec(&start);
+		hist_record(&hists[OP_QUERY], elapsed);
+		hist_record(&hists[ce ? OP_CACHED : OP_SEARCH], elapsed);
+		if (print_stats) {
+			fflush(stdout);
+			if (sc.sc_dir) {
+				fprintf(stderr, "shard cache : %lu hits, %lu "
+				    "misses\n", sc.sc_hits, sc.sc_misses);
+			} else if (incremental) {
+				fprintf(stderr, "incremental : %lu deficits "
+				    "updated\n", is.is_touched);
+			} else if (!EMBEDDED) {
+				print_bloom_stats(&th.th_bloom);
+			}
+			print_cache_stats(&rc);
+			fprintf(stderr, "time in microseconds for query%s : "
+			    "%lu\n", ce ? " (cached)" : "", elapsed);
+		}
 	}
 	return (0);
 }